@@ -12,6 +12,13 @@ uniform float u_value_a;
 uniform float u_value_b;
 uniform vec2 u_grid_offset;
 uniform int u_level_factor;
+// where this patch lies within the texture layer it samples: (0, 0) and 1
+// for its own patch, or a sub-square of an ancestor's patch standing in
+uniform vec2 u_tex_offset;
+uniform float u_tex_scale;
+// stored patch values map back to heights and gradients as offset + value * range
+uniform vec3 u_patch_offset;
+uniform vec3 u_patch_range;
 in vec3 vPos;
 out vec4 groundColour;
 out vec3 groundNormal;
@@ -19,25 +26,11 @@ out vec2 groundPos;
 out float groundHeight;
 out vec3 worldPos;
 
-vec3 sobol(vec3 tpos, float offset)
+vec3 surfaceNormal(vec2 gradient)
 {
-    // Derive normal using a Sobel filter
-    float topLeft = texture(u_heightmap, vec3(tpos.xy + offset * ivec2(-1., 1.),tpos.z)).r;
-    float topMiddle = texture(u_heightmap, vec3(tpos.xy + offset * ivec2(0., 1.),tpos.z)).r;
-    float topRight = texture(u_heightmap, vec3(tpos.xy + offset * ivec2(1., 1.),tpos.z)).r;
-    float left = texture(u_heightmap, vec3(tpos.xy + offset * ivec2(-1., 0.),tpos.z)).r;
-    float right = texture(u_heightmap, vec3(tpos.xy + offset * ivec2(1., 0.),tpos.z)).r;
-    float bottomLeft = texture(u_heightmap, vec3(tpos.xy + offset * ivec2(-1., -1.),tpos.z)).r;
-    float bottomMiddle = texture(u_heightmap, vec3(tpos.xy + offset * ivec2(0., -1.),tpos.z)).r;
-    float bottomRight = texture(u_heightmap, vec3(tpos.xy + offset * ivec2(1., -1.),tpos.z)).r;
-    // (-1,-2,-1, 0,0,0, 1,2,1) for both left->right and top->bottom
-    float x = topRight + right * 2. + bottomRight - topLeft - left * 2. - bottomLeft;
-    float z = bottomLeft + bottomMiddle * 2. + bottomRight - topLeft - topMiddle * 2. - topRight;
-
-    x /= u_level_factor * u_grid_scale / u_grid_size;
-    z /= u_level_factor * u_grid_scale / u_grid_size;
-
-    return normalize(vec3(x, 1., z));
+    // The heightmap's .gb channels hold the analytic gradient of the height
+    // in world units, so the normal needs no neighbouring samples.
+    return normalize(vec3(-gradient.x, 1., -gradient.y));
 }
 
 void main()
@@ -55,18 +48,18 @@ void main()
         float edge = 0.5 + u_grid_size/8.0;
         // 0 -> 1.5
         // 1 -> num_pixels-1.5
-        vec3 tpos = vec3((num_pixels-edge*2.0)/num_pixels * patchpos / u_level_factor + vec2(edge/num_pixels), u_layer);
-
-        float normal_offset = 1 / num_pixels;
+        vec2 texpos = patchpos / u_level_factor * u_tex_scale + u_tex_offset;
+        vec3 tpos = vec3((num_pixels-edge*2.0)/num_pixels * texpos + vec2(edge/num_pixels), u_layer);
 
-        groundNormal = sobol(tpos, normal_offset);
-        height = texture(u_heightmap, tpos).r;
+        vec3 heightSample = u_patch_offset + texture(u_heightmap, tpos).rgb * u_patch_range;
+        groundNormal = surfaceNormal(heightSample.gb);
+        height = heightSample.r;
         if (height < 1) {
             // height is max 1, so this results in 0..1
             float depth = min(4, -height + 1) / 4;
             depth = smoothstep(0, 1, depth);
             float waveTime = u_time;
-            vec3 waterNormal1 = sobol(tpos, normal_offset / 4) * 10;
+            vec3 waterNormal1 = groundNormal * 10;
             float waterValue = sin(world_pos.x / 17 + waveTime * depth) +
                             cos(world_pos.x / 127 + waveTime / 7)  *
                             cos(world_pos.y / 137 + waveTime / 19) ;
@@ -0,0 +1,286 @@
+// terrain_gl
+// @codedstructure 2023
+
+// Headless terrain baking: generates every patch of one level over a
+// rectangle of grid units on all cores, without a window or GL context,
+// and writes them either to a patch cache file the viewer loads as if it
+// had generated them itself, or as a raw image of heights.
+//
+//   terrain_bake <level> <x0> <y0> <x1> <y1> [options]
+//     --format cache|float|uint16   output format (default cache)
+//     --output <path>               (default terrain_patches.cache, or
+//                                    terrain_bake.raw for images)
+//     --threads <n>                 (default every core)
+//     --range <low> <high>          heights mapped to 0..65535 in uint16
+//                                   images (default the level's full range)
+//
+// Images are row-major, native-endian samples at the level's sample
+// spacing, one row per grid_size-th of a patch along y, covering whole
+// patches from the one containing (x0, y0). Their size and height range
+// are printed on completion.
+//
+// Coordinates are limited to +/-2^27 grid units and the level to 27, the
+// range patch keys can tell apart.
+//
+// The rectangle is generated a tile of patches at a time, so memory use
+// doesn't grow with its size. Patches already in a cache file are kept,
+// so an interrupted bake can simply be rerun.
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "heightmap.h"
+#include "patch_file.h"
+#include "terrain_config.h"
+
+enum class BakeFormat { Cache, Float, Uint16 };
+
+struct BakeOptions {
+    int level;
+    int x0, y0, x1, y1;
+    BakeFormat format = BakeFormat::Cache;
+    std::string output;
+    int threads = 0;
+    bool ranged = false;
+    float low = 0, high = 0;
+};
+
+// edge of the square tiles of patches generated at once
+const int tile_patches = 32;
+
+static void usage() {
+    std::cerr << "usage: terrain_bake <level> <x0> <y0> <x1> <y1> [--format cache|float|uint16]\n"
+                 "                    [--output <path>] [--threads <n>] [--range <low> <high>]\n";
+}
+
+static bool parse_options(int argc, char* argv[], BakeOptions& options) {
+    if (argc < 6) {
+        return false;
+    }
+    // Every patch origin must fit the keys' coordinate bits, or patches
+    // would alias one another: so must the rectangle, and the patches of
+    // the level must be no wider than that.
+    char* end;
+    int* const coordinates[] = {&options.level, &options.x0, &options.y0, &options.x1, &options.y1};
+    for (int i = 0; i < 5; i++) {
+        const long value = std::strtol(argv[i + 1], &end, 10);
+        if (*end != '\0' || value < -patch_coord_limit || value > patch_coord_limit) {
+            return false;
+        }
+        *coordinates[i] = int(value);
+    }
+    for (int i = 6; i < argc; i++) {
+        const std::string option = argv[i];
+        const int remaining = argc - i - 1;
+        if (option == "--format" && remaining >= 1) {
+            const std::string format = argv[++i];
+            if (format == "cache") {
+                options.format = BakeFormat::Cache;
+            } else if (format == "float") {
+                options.format = BakeFormat::Float;
+            } else if (format == "uint16") {
+                options.format = BakeFormat::Uint16;
+            } else {
+                return false;
+            }
+        } else if (option == "--output" && remaining >= 1) {
+            options.output = argv[++i];
+        } else if (option == "--threads" && remaining >= 1) {
+            options.threads = std::atoi(argv[++i]);
+        } else if (option == "--range" && remaining >= 2) {
+            options.low = std::strtof(argv[++i], nullptr);
+            options.high = std::strtof(argv[++i], nullptr);
+            options.ranged = options.high > options.low;
+            if (!options.ranged) {
+                return false;
+            }
+        } else {
+            return false;
+        }
+    }
+    if (options.output.empty()) {
+        options.output = options.format == BakeFormat::Cache ? patch_cache_path : "terrain_bake.raw";
+    }
+    return options.level >= 0 && options.level < patch_coord_bits && options.x1 > options.x0 &&
+           options.y1 > options.y0;
+}
+
+// the whole patches covering the requested rectangle
+struct BakeRegion {
+    int first_x, first_y;
+    int columns, rows;
+    int step;
+
+    // in 64 bits, as the rectangle's far edge rounded up to a whole patch
+    // can overflow an int
+    template<typename T>
+    BakeRegion(HeightMap<T>& heightMap, const BakeOptions& options) : step(heightMap.level_factor) {
+        auto floor_patch = [this](int64_t v) { return (v >= 0 ? v : v - step + 1) / step * step; };
+        first_x = int(floor_patch(options.x0));
+        first_y = int(floor_patch(options.y0));
+        columns = int((int64_t(options.x1) - first_x + step - 1) / step);
+        rows = int((int64_t(options.y1) - first_y + step - 1) / step);
+    }
+
+    // Calls bake_tile(x0, y0, x1, y1, column, row) for each tile of patches,
+    // where column and row count patches from the region's first.
+    template<typename F>
+    void forEachTile(F&& bake_tile) const {
+        for (int row = 0; row < rows; row += tile_patches) {
+            for (int column = 0; column < columns; column += tile_patches) {
+                const int x = first_x + column * step;
+                const int y = first_y + row * step;
+                bake_tile(x, y, x + std::min(tile_patches, columns - column) * step,
+                          y + std::min(tile_patches, rows - row) * step, column, row);
+            }
+            std::cerr << "\r" << std::min(rows, row + tile_patches) << "/" << rows << " patch rows" << std::flush;
+        }
+        std::cerr << "\n";
+    }
+};
+
+static int bake_cache(const BakeOptions& options) {
+    const size_t tile_bytes = size_t(tile_patches) * tile_patches * patchLength<PatchSample>(grid_size) * sizeof(PatchSample);
+    PatchStore<PatchSample> store(patchLength<PatchSample>(grid_size), tile_bytes, patch_layout);
+    HeightMap<PatchSample> heightMap(grid_size, grid_scale, options.level, store, octave_fill, nullptr,
+                                     composedSource());
+    PatchFile<PatchSample> file(options.output, heightMap.generatorHash(), store.patchLength());
+    if (!file.isOpen()) {
+        return EXIT_FAILURE;
+    }
+    const BakeRegion region(heightMap, options);
+    const int step = region.step;
+    auto baked = [&](int x0, int y0, int x1, int y1) {
+        long count = 0;
+        for (int y = y0; y < y1; y += step) {
+            for (int x = x0; x < x1; x += step) {
+                count += file.contains(packPatchKey(options.level, x, y));
+            }
+        }
+        return count;
+    };
+    const long patches = long(region.columns) * region.rows;
+    const long already_baked = baked(region.first_x, region.first_y, region.first_x + region.columns * step,
+                                     region.first_y + region.rows * step);
+    if (patches - already_baked > long(file.capacity() - file.patchCount())) {
+        std::cerr << "Not enough room in " << options.output << " for " << patches - already_baked
+                  << " more patches; it holds at most " << file.capacity() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    region.forEachTile([&](int x0, int y0, int x1, int y1, int, int) {
+        if (baked(x0, y0, x1, y1) == long(x1 - x0) / step * ((y1 - y0) / step)) {
+            return;
+        }
+        heightMap.generateRegion(x0, y0, x1, y1, options.threads);
+        for (int y = y0; y < y1; y += step) {
+            for (int x = x0; x < x1; x += step) {
+                file.append(packPatchKey(options.level, x, y), store.find(options.level, x, y), true);
+            }
+        }
+    });
+    file.close();
+
+    std::cout << options.output << ": " << patches << " patches at level " << options.level
+              << " (" << already_baked << " already baked)\n";
+    return EXIT_SUCCESS;
+}
+
+static int bake_image(const BakeOptions& options) {
+    const size_t tile_bytes = size_t(tile_patches) * tile_patches * patchLength<float>(grid_size) * sizeof(float);
+    PatchStore<float> store(patchLength<float>(grid_size), tile_bytes, patch_layout);
+    HeightMap<float> heightMap(grid_size, grid_scale, options.level, store, octave_fill, nullptr,
+                               composedSource());
+    float low, high;
+    std::tie(low, high) = options.ranged ? std::make_pair(options.low, options.high) : heightMap.heightRange();
+    const size_t sample_bytes = options.format == BakeFormat::Float ? sizeof(float) : sizeof(uint16_t);
+
+    std::ofstream image(options.output, std::ios::binary | std::ios::trunc);
+    if (!image) {
+        std::cerr << "Could not open " << options.output << ": " << std::strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+
+    // neighbouring patches share their edge samples
+    const BakeRegion region(heightMap, options);
+    const int step = region.step;
+    const size_t width = size_t(region.columns) * grid_size + 1;
+    const int low_sample = -grid_size / 8;
+    const int edge = patchEdge(grid_size);
+
+    std::vector<const float*> tile;
+    std::vector<char> row_bytes;
+    region.forEachTile([&](int x0, int y0, int x1, int y1, int column, int row) {
+        heightMap.generateRegion(x0, y0, x1, y1, options.threads);
+        const int tile_columns = (x1 - x0) / step;
+        const int tile_rows = (y1 - y0) / step;
+        tile.clear();
+        for (int y = y0; y < y1; y += step) {
+            for (int x = x0; x < x1; x += step) {
+                tile.push_back(store.find(options.level, x, y));
+            }
+        }
+
+        const int tile_width = tile_columns * grid_size + 1;
+        const int tile_height = tile_rows * grid_size + 1;
+        row_bytes.resize(tile_width * sample_bytes);
+        for (int j = 0; j < tile_height; j++) {
+            // the last row and column of samples come from the patch before
+            const int patch_row = std::min(j / grid_size, tile_rows - 1);
+            for (int i = 0; i < tile_width; i++) {
+                const int patch_column = std::min(i / grid_size, tile_columns - 1);
+                const float* patch = tile[patch_row * tile_columns + patch_column];
+                const int u = i - patch_column * grid_size - low_sample;
+                const int v = j - patch_row * grid_size - low_sample;
+                const float height = patch[patchSampleIndex(patch_layout, edge, u, v) * patch_channels];
+                if (options.format == BakeFormat::Float) {
+                    std::memcpy(&row_bytes[i * sample_bytes], &height, sizeof(height));
+                } else {
+                    const float normalised = std::clamp((height - low) / (high - low), 0.f, 1.f);
+                    const uint16_t sample = uint16_t(std::lround(normalised * 65535));
+                    std::memcpy(&row_bytes[i * sample_bytes], &sample, sizeof(sample));
+                }
+            }
+            const size_t image_row = size_t(row) * grid_size + j;
+            const size_t image_column = size_t(column) * grid_size;
+            image.seekp(std::streamoff((image_row * width + image_column) * sample_bytes));
+            image.write(row_bytes.data(), std::streamsize(row_bytes.size()));
+        }
+    });
+    image.close();
+    if (!image) {
+        std::cerr << "Could not write " << options.output << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << options.output << ": " << width << " x " << size_t(region.rows) * grid_size + 1
+              << (options.format == BakeFormat::Float ? " float" : " uint16") << " samples, "
+              << float(step) / grid_size << " grid units apart, from (" << region.first_x << ", " << region.first_y << ")\n";
+    if (options.format == BakeFormat::Uint16) {
+        std::cout << "height = " << low << " + sample * " << (high - low) / 65535 << "\n";
+    }
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char* argv[]) {
+    BakeOptions options;
+    if (!parse_options(argc, argv, options)) {
+        usage();
+        return EXIT_FAILURE;
+    }
+    auto start = std::chrono::steady_clock::now();
+    int result = options.format == BakeFormat::Cache ? bake_cache(options) : bake_image(options);
+    std::cout << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s\n";
+    return result;
+}
@@ -0,0 +1,958 @@
+// terrain_gl
+// @codedstructure 2023
+
+// Patch generation benchmark: no window or GL context needed.
+// Times HeightMap::generatePatch() for each terrain level against the
+// original one-heightAt()-per-sample loop, and checks level 0 agrees exactly.
+// Then times generating levels from samples already cached for the levels
+// either side of them, background generation on the worker threads, cold
+// and warm runs through the on-disk patch cache, the error 16-bit patches
+// introduce, patches from an elevation model and from composed generators,
+// row-major against tiled patches, patch bounds pyramids against the heights
+// they bound, texture layer eviction policies, layers shared between levels,
+// and patch index lookups against std::map.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "generator.h"
+#include "height_source.h"
+#include "heightmap.h"
+#include "layer_residency.h"
+#include "patch_index.h"
+#include "patch_store.h"
+#include "patch_workers.h"
+#include "simplexnoise1234.h"
+#include "terrain_config.h"
+
+using Clock = std::chrono::steady_clock;
+
+// values in a float patch before its bounds pyramid
+static const size_t patch_values = size_t(patchEdge(grid_size)) * patchEdge(grid_size) * patch_channels;
+
+static double elapsed_ms(Clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// Stores a timed loop's result where the compiler must assume it's read,
+// so the loop isn't optimised away.
+static volatile float sink;
+static void keep(float result) {
+    sink = result;
+}
+
+// The per-sample loop generatePatch() replaced, kept as the reference.
+static void reference_patch(HeightMap<float>& heightMap, int grid_x, int grid_y, std::vector<float>& target) {
+    auto low = -heightMap.size * 0.125;
+    auto high = heightMap.size * 1.125;
+    auto step_size = float(heightMap.level_factor) / heightMap.size;
+
+    target.clear();
+    for (int y = low; y <= high; y++) {
+        for (int x = low; x <= high; x++) {
+            float fx = float(x) * step_size + grid_x;
+            float fy = float(y) * step_size + grid_y;
+            float dh_dx, dh_dz;
+            target.push_back(heightMap.heightAt(fx, fy, dh_dx, dh_dz));
+            target.push_back(dh_dx);
+            target.push_back(dh_dz);
+        }
+    }
+}
+
+// Generates every patch of a level across [0, extent) x [0, extent) grid
+// units through getPatchFor(), so anything already in the store is reused.
+// Returns ms per patch, with every height generated left in heights.
+static double generate_area(PatchStore<float>& store, int level, int extent,
+                            std::vector<float>& heights, const HeightSource* source = nullptr) {
+    HeightMap<float> heightMap(grid_size, grid_scale, level, store, OctaveFill::Drop, nullptr, source);
+    const int step = heightMap.level_factor;
+    int patches = 0;
+    heights.clear();
+    auto start = Clock::now();
+    for (int y = 0; y < extent; y += step) {
+        for (int x = 0; x < extent; x += step) {
+            const float* patch = heightMap.getPatchFor(x, y);
+            for (size_t i = 0; i < patch_values; i += patch_channels) {
+                heights.push_back(patch[i]);
+            }
+            patches++;
+        }
+    }
+    return elapsed_ms(start) / patches;
+}
+
+static float max_difference(const std::vector<float>& a, const std::vector<float>& b) {
+    float max_error = 0;
+    for (size_t i = 0; i < a.size() && i < b.size(); i++) {
+        max_error = std::max(max_error, std::abs(a[i] - b[i]));
+    }
+    return max_error;
+}
+
+// Requests every patch of all five levels over an area through the worker
+// threads, as the render loop does, polling until they're all ready. They're
+// prioritised by distance from the centre of the area, as if the player were
+// there. Reports patches per second, how soon the level 0 patch under the
+// centre was ready, and the longest any requestPatch() call took, which is
+// what the render thread would wait. Each finished patch is also copied out
+// on its worker as the viewer stages uploads. Returns false if any patch
+// differs from one generated synchronously, or wasn't handed over staged.
+static bool background_generation(int extent) {
+    const int levels = 5;
+    PatchStore<float> store(patchLength<float>(grid_size));
+    PatchWorkers<float> workers;
+    std::atomic<int> built{0}, staged{0};
+    workers.onBuilt([&](HeightMap<float>& heightMap, int x, int y) {
+        static thread_local std::vector<float> staging(patch_values);
+        built++;
+        if (const float* patch = store.acquire(heightMap.level, x, y)) {
+            patchToRowMajor(patch, patchEdge(grid_size), store.layout(), staging.data());
+            store.unpin(packPatchKey(heightMap.level, x, y));
+            staged++;
+        }
+    });
+    std::vector<std::unique_ptr<HeightMap<float>>> heightMaps;
+    for (int level = 0; level < levels; level++) {
+        heightMaps.emplace_back(new HeightMap<float>(grid_size, grid_scale, level, store, OctaveFill::Drop, &workers));
+    }
+
+    const float centre = extent / 2.f;
+    int patches = 0;
+    double longest_request_ms = 0;
+    double centre_ready_ms = -1;
+    auto start = Clock::now();
+    for (bool waiting = true; waiting; std::this_thread::yield()) {
+        waiting = false;
+        patches = 0;
+        for (auto& heightMap : heightMaps) {
+            const int step = heightMap->level_factor;
+            for (int y = 0; y < extent; y += step) {
+                for (int x = 0; x < extent; x += step) {
+                    float priority = std::hypot(x + step / 2.f - centre, y + step / 2.f - centre) / step;
+                    auto request_start = Clock::now();
+                    auto patch = heightMap->requestPatch(x, y, priority);
+                    longest_request_ms = std::max(longest_request_ms, elapsed_ms(request_start));
+                    if (patch == nullptr) {
+                        waiting = true;
+                    } else {
+                        store.unpin(packPatchKey(heightMap->level, x, y));
+                        if (heightMap->level == 0 && x == int(centre) && y == int(centre) && centre_ready_ms < 0) {
+                            centre_ready_ms = elapsed_ms(start);
+                        }
+                    }
+                    patches++;
+                }
+            }
+        }
+    }
+    double total_ms = elapsed_ms(start);
+    workers.stop();
+
+    // Cross-level reuse depends on which neighbours were ready first, so
+    // the heights can differ from a synchronous run by float rounding.
+    PatchStore<float> serial_store(patchLength<float>(grid_size));
+    std::vector<float> serial(store.patchLength());
+    float max_error = 0;
+    for (auto& heightMap : heightMaps) {
+        HeightMap<float> serialMap(grid_size, grid_scale, heightMap->level, serial_store);
+        const int step = heightMap->level_factor;
+        for (int y = 0; y < extent; y += step) {
+            for (int x = 0; x < extent; x += step) {
+                serialMap.generatePatch(x, y, serial.data());
+                const float* patch = store.find(heightMap->level, x, y);
+                for (size_t i = 0; i < patch_values; i += patch_channels) {
+                    max_error = std::max(max_error, std::abs(patch[i] - serial[i]));
+                }
+            }
+        }
+    }
+
+    std::cout << "\nbackground generation (" << PatchWorkers<float>::defaultThreads() << " workers, "
+              << patches << " patches)\n";
+    std::cout << "patches/s  all ready ms  centre ready ms  longest requestPatch ms  max height error\n";
+    std::cout << patches * 1000 / total_ms << "    " << total_ms << "       " << centre_ready_ms << "          "
+              << longest_request_ms << "                   " << max_error << "\n";
+    std::cout << staged << " of " << built << " built patches staged\n";
+    return max_error < 1e-3 && built == patches && staged == built;
+}
+
+// Inserts a patch again while it's pinned, as a second build of it would,
+// then churns a store of two patches through more. Returns false if the
+// reinsert didn't hand back the pinned patch, or its buffer was reused.
+static bool pinned_reinsert() {
+    PatchStore<float> store(patchLength<float>(grid_size), 2 * patchLength<float>(grid_size) * sizeof(float));
+    HeightMap<float> heightMap(grid_size, grid_scale, 0, store);
+    heightMap.buildPatch(0, 0);
+    const float* pinned = store.acquire(0, 0, 0);
+    std::vector<float> expected(pinned, pinned + patch_values);
+
+    auto handle = store.allocate();
+    heightMap.generatePatch(0, 0, store.data(handle));
+    bool kept = store.insert(0, 0, 0, handle) == pinned;
+    for (int x = 1; x <= 4; x++) {
+        heightMap.buildPatch(x * heightMap.level_factor, 0);
+    }
+    kept = kept && std::equal(expected.begin(), expected.end(), pinned);
+    store.unpin(packPatchKey(0, 0, 0));
+
+    std::cout << "\npinned reinsert: " << (kept ? "pinned patch kept\n" : "PINNED PATCH OVERWRITTEN\n");
+    return kept;
+}
+
+// Generates an area on every level with a fresh patch cache file attached,
+// waits for it to be written, then reopens it and generates the same area
+// again as a new session would. Returns false if the warm run computed any
+// noise or its heights differ.
+static bool disk_cache(int extent) {
+    const char* path = "terrain_bench_patches.cache";
+    const int levels = 5;
+    std::remove(path);
+    uint64_t generator;
+    {
+        PatchStore<float> probe(patchLength<float>(grid_size));
+        generator = HeightMap<float>(grid_size, grid_scale, 0, probe).generatorHash();
+    }
+
+    std::vector<std::vector<float>> cold(levels), warm(levels);
+    double cold_ms = 0, warm_ms = 0;
+    long warm_samples;
+    {
+        PatchStore<float> store(patchLength<float>(grid_size));
+        PatchFile<float> file(path, generator, store.patchLength());
+        store.attachFile(&file);
+        for (int level = 0; level < levels; level++) {
+            cold_ms += generate_area(store, level, extent, cold[level]);
+        }
+    }
+    {
+        PatchStore<float> store(patchLength<float>(grid_size));
+        PatchFile<float> file(path, generator, store.patchLength());
+        store.attachFile(&file);
+        for (int level = 0; level < levels; level++) {
+            warm_ms += generate_area(store, level, extent, warm[level]);
+        }
+        warm_samples = store.computed_samples + store.reused_samples;
+    }
+    std::remove(path);
+
+    float max_error = 0;
+    for (int level = 0; level < levels; level++) {
+        max_error = std::max(max_error, max_difference(cold[level], warm[level]));
+    }
+    std::cout << "\npatch cache file\n";
+    std::cout << "cold ms/patch  warm ms/patch  warm samples computed  max height error\n";
+    std::cout << cold_ms / levels << "       " << warm_ms / levels << "       " << warm_samples
+              << "                      " << max_error << "\n";
+    return warm_samples == 0 && max_error == 0;
+}
+
+// Worst-case error of 16-bit quantized patches against float patches.
+// Generates the same area for every level, coarsest first, once in float
+// and once quantized, each in a store shared between the levels as in the
+// viewer, so any error carried through cross-level reuse is included.
+// Also checks storedHeightAt() reads the quantized heights back.
+static void quantization_error(int extent) {
+    const int levels = 5;
+    const size_t float_length = patchLength<float>(grid_size);
+    const size_t quantized_length = patchLength<uint16_t>(grid_size);
+    const size_t values = patch_values;
+    PatchStore<float> float_store(float_length);
+    PatchStore<uint16_t> quantized_store(quantized_length);
+
+    std::cout << "\n16-bit patches: " << quantized_length * sizeof(uint16_t) << " bytes vs "
+              << float_length * sizeof(float) << "\n";
+    std::cout << "level  max height error  max gradient error  max height range  max storedHeightAt error\n";
+    for (int level = levels - 1; level >= 0; level--) {
+        HeightMap<float> floatMap(grid_size, grid_scale, level, float_store);
+        HeightMap<uint16_t> quantizedMap(grid_size, grid_scale, level, quantized_store);
+        const int step = floatMap.level_factor;
+        float height_error = 0, gradient_error = 0, height_range = 0, stored_error = 0;
+        for (int y = 0; y < extent; y += step) {
+            for (int x = 0; x < extent; x += step) {
+                const float* exact = floatMap.getPatchFor(x, y);
+                const uint16_t* quantized = quantizedMap.getPatchFor(x, y);
+                const auto quantization = patchQuantization(quantized, values);
+                height_range = std::max(height_range, quantization.range[0]);
+                for (size_t i = 0; i < values; i += patch_channels) {
+                    height_error = std::max(height_error, std::abs(decodeValue(&quantized[i], quantization, 0) - exact[i]));
+                    for (int channel = 1; channel < patch_channels; channel++) {
+                        gradient_error = std::max(gradient_error, std::abs(
+                                decodeValue(&quantized[i], quantization, channel) - exact[i + channel]));
+                    }
+                }
+                // and read back through storedHeightAt() along the patch edge
+                for (int sample = 0; sample < grid_size; sample += 8) {
+                    float fx = x + float(sample) * step / grid_size;
+                    float stored, exact_stored;
+                    if (quantizedMap.storedHeightAt(fx, y, stored) && floatMap.storedHeightAt(fx, y, exact_stored)) {
+                        stored_error = std::max(stored_error, std::abs(stored - exact_stored));
+                    }
+                }
+            }
+        }
+        std::cout << level << "      " << height_error << "         " << gradient_error << "          "
+                  << height_range << "           " << stored_error << "\n";
+    }
+}
+
+// Patches from an elevation model instead of noise: the same synthetic
+// model written as native-endian raw samples, which rows aligned to its
+// samples read directly, and as a (big-endian) PGM, which always goes
+// through the interpolating path. Returns false if the two disagree, or
+// generateRegion() differs from getPatchFor() on the raw model.
+static bool dem_source(int extent) {
+    const char* raw_path = "terrain_bench_dem.raw";
+    const char* pgm_path = "terrain_bench_dem.pgm";
+    const int levels = 5;
+    // covering the area's aprons, one sample per world unit
+    const int margin = grid_size / 4;
+    const size_t width = extent * grid_size + 2 * margin + 1;
+    std::vector<uint16_t> model(width * width);
+    {
+        PatchStore<float> store(patchLength<float>(grid_size));
+        HeightMap<float> noise(grid_size, grid_scale, 0, store);
+        for (size_t j = 0; j < width; j++) {
+            for (size_t i = 0; i < width; i++) {
+                float x = float(int(i) - margin) / grid_size;
+                float y = float(int(j) - margin) / grid_size;
+                model[j * width + i] = uint16_t(std::lround((noise.heightAt(x, y) + 64) * 256));
+            }
+        }
+    }
+    std::FILE* raw = std::fopen(raw_path, "wb");
+    std::fwrite(model.data(), sizeof(uint16_t), model.size(), raw);
+    std::fclose(raw);
+    std::FILE* pgm = std::fopen(pgm_path, "wb");
+    std::fprintf(pgm, "P5\n# bench model\n%zu %zu\n65535\n", width, width);
+    for (uint16_t sample : model) {
+        const unsigned char bytes[2] = {static_cast<unsigned char>(sample >> 8), static_cast<unsigned char>(sample)};
+        std::fwrite(bytes, 1, 2, pgm);
+    }
+    std::fclose(pgm);
+
+    DemHeightSource::Layout layout;
+    layout.width = layout.height = width;
+    layout.origin_x = layout.origin_y = -float(margin) / grid_size;
+    layout.spacing = 1.f / grid_size;
+    layout.height_offset = -64;
+    layout.height_scale = 1.f / 256;
+    DemHeightSource raw_source(raw_path, layout);
+    DemHeightSource pgm_source(pgm_path, layout);
+
+    bool agree = raw_source.isOpen() && pgm_source.isOpen();
+    std::vector<float> from_raw, from_pgm, by_region;
+    std::cout << "\nelevation model (" << width << "x" << width << " samples)\n";
+    std::cout << "level  raw ms/patch  pgm ms/patch  raw vs pgm max error  region max error\n";
+    for (int level = 0; level < levels && agree; level++) {
+        PatchStore<float> raw_store(patchLength<float>(grid_size));
+        double raw_ms = generate_area(raw_store, level, extent, from_raw, &raw_source);
+        PatchStore<float> pgm_store(patchLength<float>(grid_size));
+        double pgm_ms = generate_area(pgm_store, level, extent, from_pgm, &pgm_source);
+
+        PatchStore<float> region_store(patchLength<float>(grid_size));
+        HeightMap<float> regionMap(grid_size, grid_scale, level, region_store, OctaveFill::Drop, nullptr, &raw_source);
+        regionMap.generateRegion(0, 0, extent, extent);
+        generate_area(region_store, level, extent, by_region, &raw_source);
+
+        float pgm_error = max_difference(from_raw, from_pgm);
+        float region_error = max_difference(from_raw, by_region);
+        agree = agree && pgm_error == 0 && region_error == 0;
+        std::cout << level << "      " << raw_ms << "        " << pgm_ms << "        " << pgm_error
+                  << "                     " << region_error << "\n";
+    }
+    std::remove(raw_path);
+    std::remove(pgm_path);
+    return agree;
+}
+
+// Patches from generators composed with gen::, at level 0 over an area: the
+// built-in fBm rebuilt as a composition, which must match HeightMap's own
+// noise exactly, and a richer composition of every kind of node. Returns
+// false if the rebuilt fBm differs.
+static bool composed_generators(int extent) {
+    // HeightMap's octaves: 30 * 2^-k amplitude at 2^k / 16 frequency,
+    // offset by 5 (at grid_scale 64, heights need no further scaling)
+    auto fbm = gen::scaleBias(gen::octaves(gen::simplex(), 10, 1.f / 16, 30), grid_scale / 64.f, 5);
+    auto mountains = gen::blend(
+            gen::scaleBias(gen::ridged(gen::octaves(gen::simplex(), 6, 1.f / 32, 0.6f)), 60, -20),
+            gen::warp(gen::billow(gen::octaves(gen::simplex(), 8, 1.f / 16, 15)),
+                      gen::octaves(gen::simplex(), 2, 1.f / 8, 1), 2),
+            gen::scaleBias(gen::max(gen::octaves(gen::simplex(), 2, 1.f / 256, 1),
+                                    gen::min(gen::simplex(), gen::scaleBias(gen::simplex(), 0.5f, 0))), 0.5f, 0.5f));
+    GeneratorSource fbm_source(fbm);
+    GeneratorSource mountains_source(mountains);
+
+    std::vector<float> builtin, composed, unused;
+    PatchStore<float> builtin_store(patchLength<float>(grid_size));
+    double builtin_ms = generate_area(builtin_store, 0, extent, builtin);
+    PatchStore<float> fbm_store(patchLength<float>(grid_size));
+    double fbm_ms = generate_area(fbm_store, 0, extent, composed, &fbm_source);
+    PatchStore<float> mountains_store(patchLength<float>(grid_size));
+    double mountains_ms = generate_area(mountains_store, 0, extent, unused, &mountains_source);
+
+    float max_error = max_difference(builtin, composed);
+    std::cout << "\ncomposed generators (level 0)\n";
+    std::cout << "built-in fBm ms/patch  composed fBm ms/patch  max height error  composed mountains ms/patch\n";
+    std::cout << builtin_ms << "              " << fbm_ms << "               " << max_error
+              << "                 " << mountains_ms << "\n";
+    return max_error == 0 && fbm_source.identity() != mountains_source.identity();
+}
+
+// Row-major against 8x8-tiled patches. Generates every level over an area
+// in each layout, coarsest first so cross-level reuse reads the layout too,
+// and checks the tiled patches match once converted to row-major. Then
+// times a CPU Sobel kernel at random points over the level 0 patches, and
+// the conversion each tiled patch needs before upload.
+static bool patch_layouts(int extent) {
+    const int levels = 5;
+    const int edge = patchEdge(grid_size);
+    const int low = -grid_size / 8;
+    const size_t length = patchLength<float>(grid_size);
+    std::vector<float> row_major(length), converted(length);
+    std::vector<std::vector<float>> level0(2);
+    float max_error = 0;
+    double sobel_ms[2], convert_ms = 0;
+    for (PatchLayout layout : {PatchLayout::RowMajor, PatchLayout::Tiled}) {
+        const int l = int(layout);
+        PatchStore<float> store(length, SIZE_MAX, layout);
+        std::vector<const float*> patches;
+        for (int level = levels - 1; level >= 0; level--) {
+            HeightMap<float> heightMap(grid_size, grid_scale, level, store);
+            for (int y = 0; y < extent; y += heightMap.level_factor) {
+                for (int x = 0; x < extent; x += heightMap.level_factor) {
+                    const float* patch = heightMap.getPatchFor(x, y);
+                    if (level == 0) {
+                        patches.push_back(patch);
+                    }
+                }
+            }
+        }
+        // the level 0 patches in row-major order, timing the conversion
+        auto start = Clock::now();
+        for (const float* patch : patches) {
+            patchToRowMajor(patch, edge, layout, converted.data());
+            level0[l].insert(level0[l].end(), converted.begin(), converted.begin() + size_t(edge) * edge * patch_channels);
+        }
+        if (layout == PatchLayout::Tiled) {
+            convert_ms = elapsed_ms(start) / patches.size();
+        }
+
+        // gradient magnitude from the 3x3 heights around random samples
+        std::mt19937 rng(7);
+        std::uniform_int_distribution<size_t> which(0, patches.size() - 1);
+        std::uniform_int_distribution<int> position(1 - low, grid_size - low - 1);
+        start = Clock::now();
+        float total = 0;
+        for (int n = 0; n < 1 << 20; n++) {
+            const float* patch = patches[which(rng)];
+            const int i = position(rng), j = position(rng);
+            auto h = [&](int di, int dj) {
+                return patch[patchSampleIndex(layout, edge, i + di, j + dj) * patch_channels];
+            };
+            const float gx = (h(1, -1) + 2 * h(1, 0) + h(1, 1)) - (h(-1, -1) + 2 * h(-1, 0) + h(-1, 1));
+            const float gy = (h(-1, 1) + 2 * h(0, 1) + h(1, 1)) - (h(-1, -1) + 2 * h(0, -1) + h(1, -1));
+            total += std::sqrt(gx * gx + gy * gy);
+        }
+        keep(total);
+        sobel_ms[l] = elapsed_ms(start);
+    }
+    max_error = max_difference(level0[0], level0[1]);
+
+    std::cout << "\npatch layouts\n";
+    std::cout << "row-major Sobel ms/1M  tiled Sobel ms/1M  tiled to row-major ms/patch  max height error\n";
+    std::cout << sobel_ms[0] << "               " << sobel_ms[1] << "            " << convert_ms
+              << "                     " << max_error << "\n";
+    return max_error == 0 && level0[0].size() == level0[1].size();
+}
+
+// Checks every bound of every pyramid level of each patch of a level over
+// an area holds the stored heights of its block, recording the most the
+// finest bounds overstate a block's range by.
+template<typename T>
+static bool check_patch_bounds(PatchStore<T>& store, int level, int extent, float& slack) {
+    const int edge = patchEdge(grid_size);
+    const int low = -grid_size / 8;
+    const int levels = patchBoundsLevels(grid_size);
+    HeightMap<T> heightMap(grid_size, grid_scale, level, store);
+    bool contained = true;
+    for (int y = 0; y < extent; y += heightMap.level_factor) {
+        for (int x = 0; x < extent; x += heightMap.level_factor) {
+            const T* patch = heightMap.getPatchFor(x, y);
+            const auto quantization = patchQuantization(patch, patch_values);
+            for (int bounds_level = 0; bounds_level < levels; bounds_level++) {
+                const int blocks = patchBoundsBlocks(grid_size) >> bounds_level;
+                const int span = grid_size / blocks;
+                for (int j = 0; j < blocks; j++) {
+                    for (int i = 0; i < blocks; i++) {
+                        float lowest = std::numeric_limits<float>::max();
+                        float highest = std::numeric_limits<float>::lowest();
+                        for (int v = 0; v <= span; v++) {
+                            for (int u = 0; u <= span; u++) {
+                                const size_t sample = patchSampleIndex(store.layout(), edge, i * span + u - low,
+                                                                       j * span + v - low);
+                                const float height = decodeValue(&patch[sample * patch_channels], quantization, 0);
+                                lowest = std::min(lowest, height);
+                                highest = std::max(highest, height);
+                            }
+                        }
+                        const PatchBound bound = patchBound(patch, grid_size, bounds_level, i, j);
+                        contained = contained && bound.low <= lowest && highest <= bound.high;
+                        if (bounds_level == 0) {
+                            slack = std::max(slack, (bound.high - bound.low) - (highest - lowest));
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return contained;
+}
+
+// Patch bounds pyramids: checks them against the heights of every level
+// over an area, in float, 16-bit and tiled stores. Then times point
+// queries through heightBounds(), as the collision check makes them,
+// against heightAt(), and reports how far heightAt() strays above the
+// bounds between samples. Returns false if any stored height is out of
+// its bounds.
+static bool height_bounds(int extent) {
+    const int levels = 5;
+    PatchStore<float> float_store(patchLength<float>(grid_size));
+    PatchStore<uint16_t> quantized_store(patchLength<uint16_t>(grid_size));
+    PatchStore<float> tiled_store(patchLength<float>(grid_size), SIZE_MAX, PatchLayout::Tiled);
+    bool contained = true;
+    float slack[3] = {};
+    for (int level = levels - 1; level >= 0; level--) {
+        contained = check_patch_bounds(float_store, level, extent, slack[0]) && contained;
+        contained = check_patch_bounds(quantized_store, level, extent, slack[1]) && contained;
+        contained = check_patch_bounds(tiled_store, level, extent, slack[2]) && contained;
+    }
+
+    HeightMap<float> heightMap(grid_size, grid_scale, 0, float_store);
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<float> position(0, extent);
+    std::vector<std::pair<float, float>> points(1 << 16);
+    for (auto& point : points) {
+        point = {position(rng), position(rng)};
+    }
+    float total = 0;
+    auto start = Clock::now();
+    for (auto [x, y] : points) {
+        float low, high;
+        heightMap.heightBounds(x, y, x, y, low, high);
+        total += high;
+    }
+    double bounds_ns = elapsed_ms(start) * 1e6 / points.size();
+    start = Clock::now();
+    for (auto [x, y] : points) {
+        total += heightMap.heightAt(x, y);
+    }
+    double height_ns = elapsed_ms(start) * 1e6 / points.size();
+    keep(total);
+    float above = 0;
+    for (auto [x, y] : points) {
+        float low, high;
+        if (!heightMap.heightBounds(x, y, x, y, low, high)) {
+            contained = false;
+        }
+        above = std::max(above, heightMap.heightAt(x, y) - high);
+    }
+
+    std::cout << "\npatch bounds (" << patchBoundsCount(grid_size) * sizeof(PatchBound) << " bytes/patch)\n";
+    std::cout << "max slack float  16-bit  tiled  heightBounds ns/point  heightAt ns/point  max heightAt above\n";
+    std::cout << slack[0] << "       " << slack[1] << "  " << slack[2] << "  " << bounds_ns << "                 "
+              << height_ns << "             " << above << "\n";
+    std::cout << (contained ? "bounds hold every stored height\n" : "STORED HEIGHTS OUT OF BOUNDS\n");
+    return contained;
+}
+
+// Texture layer eviction over a simulated flight: each frame draws the
+// patches within a cone ahead of a player turning as it flies, through 256
+// layers as a Terrain level has. Compares LayerResidency with the random
+// eviction Terrain used before, counting uploads, patches evicted in the
+// same frame they're drawn, and re-uploads soon after eviction. Returns
+// false if LayerResidency ever evicts a patch drawn that frame.
+static bool layer_eviction() {
+    const int layer_count = 256;
+    const int frames = 6000;
+    const float radius = 12;
+    const long thrash_frames = 60;
+
+    LayerResidency residency(layer_count);
+    PatchIndex<int> random_layers(layer_count);
+    std::vector<PatchKey> random_keys(layer_count, LayerResidency::empty_key);
+    PatchIndex<long> random_evicted;
+    long random_uploads = 0, random_reuploads = 0, random_visible_evictions = 0;
+    long residency_visible_evictions = 0, draws = 0;
+    std::mt19937 rng(5);
+
+    std::vector<PatchKey> visible;
+    PatchIndex<long> drawn_frame;
+    for (int frame = 0; frame < frames; frame++) {
+        residency.beginFrame();
+        const float heading = frame * 0.004f + std::sin(frame * 0.01f);
+        const float px = frame * 0.05f * std::cos(heading * 0.25f);
+        const float py = frame * 0.05f * std::sin(heading * 0.25f);
+        visible.clear();
+        for (int y = int(py - radius); y <= int(py + radius); y++) {
+            for (int x = int(px - radius); x <= int(px + radius); x++) {
+                const float dx = x + 0.5f - px, dy = y + 0.5f - py;
+                const float distance = std::hypot(dx, dy);
+                const float ahead = dx * std::cos(heading) + dy * std::sin(heading);
+                if (distance < 2 || (distance < radius && ahead > 0.5f * distance)) {
+                    visible.push_back(packPatchKey(0, x, y));
+                }
+            }
+        }
+        draws += visible.size();
+
+        for (PatchKey key : visible) {
+            *drawn_frame.insert(key, frame).first = frame;
+            if (residency.find(key) < 0) {
+                PatchKey evicted;
+                if (residency.allocate(key, evicted) >= 0 && evicted != LayerResidency::empty_key) {
+                    auto evicted_drawn = drawn_frame.find(evicted);
+                    residency_visible_evictions += evicted_drawn != nullptr && *evicted_drawn == frame;
+                }
+            }
+
+            if (random_layers.find(key) == nullptr) {
+                const int layer = (rng() >> 8) % layer_count;
+                const PatchKey evicted = random_keys[layer];
+                if (evicted != LayerResidency::empty_key) {
+                    random_layers.erase(evicted);
+                    *random_evicted.insert(evicted, frame).first = frame;
+                    auto evicted_drawn = drawn_frame.find(evicted);
+                    random_visible_evictions += evicted_drawn != nullptr && *evicted_drawn == frame;
+                }
+                if (auto evicted_frame = random_evicted.find(key)) {
+                    random_reuploads += frame - *evicted_frame <= thrash_frames;
+                    random_evicted.erase(key);
+                }
+                random_layers.insert(key, layer);
+                random_keys[layer] = key;
+                random_uploads++;
+            }
+        }
+    }
+
+    std::cout << "\nlayer eviction (" << frames << " frames, " << draws / frames << " patches drawn/frame, "
+              << layer_count << " layers)\n";
+    std::cout << "policy          uploads  evicted while drawn  re-uploads  refused\n";
+    std::cout << "random          " << random_uploads << "    " << random_visible_evictions << "                "
+              << random_reuploads << "\n";
+    std::cout << "LayerResidency  " << residency.uploads << "    " << residency_visible_evictions
+              << "                    " << residency.reuploads << "          " << residency.refused << "\n";
+    return residency_visible_evictions == 0;
+}
+
+// Layers shared by every level against a fixed 256 per level, over a
+// simulated flight climbing and descending: each frame draws the patches in
+// a cone ahead on the levels the altitude calls for, the finest of them
+// only near the ground. Reports uploads, refusals (patches left to their
+// parent as every layer was in view), the most layers the shared array
+// gave each level, and the texture memory of each. Returns false if the
+// shared array refused any patch.
+static bool shared_layers() {
+    const int levels = 5;
+    const int frames = 6000;
+    const int shared_count = 512;
+    const int split_count = 256;
+    const float radius = 6;  // in patches of each level
+
+    LayerResidency shared(shared_count);
+    std::vector<std::unique_ptr<LayerResidency>> split;
+    for (int level = 0; level < levels; level++) {
+        split.emplace_back(new LayerResidency(split_count));
+    }
+    std::vector<int> most_held(levels, 0);
+    long draws = 0;
+    for (int frame = 0; frame < frames; frame++) {
+        shared.beginFrame();
+        for (auto& residency : split) {
+            residency->beginFrame();
+        }
+        const float heading = frame * 0.004f;
+        const float px = frame * 0.2f * std::cos(heading * 0.25f);
+        const float py = frame * 0.2f * std::sin(heading * 0.25f);
+        // up and down between the ground and above level 2
+        const int finest = int(1.5f - 1.5f * std::cos(frame * 0.003f) + 0.5f);
+        for (int level = finest; level < levels; level++) {
+            const int step = 1 << level;
+            const int cx = int(std::floor(px / step)), cy = int(std::floor(py / step));
+            for (int y = cy - int(radius); y <= cy + int(radius); y++) {
+                for (int x = cx - int(radius); x <= cx + int(radius); x++) {
+                    const float dx = x + 0.5f - px / step, dy = y + 0.5f - py / step;
+                    const float distance = std::hypot(dx, dy);
+                    const float ahead = dx * std::cos(heading) + dy * std::sin(heading);
+                    if (distance >= radius || (distance >= 2 && ahead <= 0.5f * distance)) {
+                        continue;
+                    }
+                    const PatchKey key = packPatchKey(level, x * step, y * step);
+                    PatchKey evicted;
+                    if (shared.find(key) < 0) {
+                        shared.allocate(key, evicted);
+                    }
+                    if (split[level]->find(key) < 0) {
+                        split[level]->allocate(key, evicted);
+                    }
+                    draws++;
+                }
+            }
+        }
+        for (int level = 0; level < levels; level++) {
+            most_held[level] = std::max(most_held[level], shared.layersHeld(level));
+        }
+    }
+
+    long split_uploads = 0, split_refused = 0;
+    for (auto& residency : split) {
+        split_uploads += residency->uploads;
+        split_refused += residency->refused;
+    }
+    const size_t layer_bytes = size_t(patchEdge(grid_size)) * patchEdge(grid_size) * patch_channels * sizeof(PatchSample);
+    std::cout << "\nshared layers (" << frames << " frames, " << draws / frames << " patches drawn/frame)\n";
+    std::cout << "layers        uploads  refused  MiB\n";
+    std::cout << levels << " x " << split_count << "       " << split_uploads << "    " << split_refused << "        "
+              << levels * split_count * layer_bytes / (1024 * 1024) << "\n";
+    std::cout << shared_count << " shared    " << shared.uploads << "    " << shared.refused << "        "
+              << shared_count * layer_bytes / (1024 * 1024) << "\n";
+    std::cout << "most shared layers held by level:";
+    for (int level = 0; level < levels; level++) {
+        std::cout << " " << most_held[level];
+    }
+    std::cout << "\n";
+    return shared.refused == 0;
+}
+
+// Per-frame layer lookups as Terrain makes them: a few hundred patches on
+// each of five levels, looked up in a shuffled order. Compares one
+// std::map<std::pair<int, int>, int> per level (how Terrain indexed layers
+// before) with a single PatchIndex. Also replaces entries as layer eviction
+// does and checks both still agree. Returns false if they ever disagree.
+static bool index_lookups() {
+    const int levels = 5;
+    const int side = 16;
+    const int lookups = 4000000;
+
+    std::vector<std::map<std::pair<int, int>, int>> maps(levels);
+    PatchIndex<int> index;
+    struct Query { int level, x, y; };
+    std::vector<Query> queries;
+    for (int level = 0; level < levels; level++) {
+        const int step = 1 << level;
+        for (int y = -side / 2; y < side / 2; y++) {
+            for (int x = -side / 2; x < side / 2; x++) {
+                int value = queries.size();
+                maps[level][{x * step, y * step}] = value;
+                index.insert(packPatchKey(level, x * step, y * step), value);
+                queries.push_back({level, x * step, y * step});
+            }
+        }
+    }
+    std::mt19937 rng(1);
+    std::shuffle(queries.begin(), queries.end(), rng);
+
+    long map_total = 0;
+    auto start = Clock::now();
+    for (int i = 0; i < lookups; i++) {
+        auto& q = queries[i % queries.size()];
+        auto& map = maps[q.level];
+        auto found = map.find({q.x, q.y});
+        map_total += found != map.end() ? found->second : -1;
+    }
+    double map_ns = elapsed_ms(start) * 1e6 / lookups;
+
+    long index_total = 0;
+    start = Clock::now();
+    for (int i = 0; i < lookups; i++) {
+        auto& q = queries[i % queries.size()];
+        auto found = index.find(packPatchKey(q.level, q.x, q.y));
+        index_total += found != nullptr ? *found : -1;
+    }
+    double index_ns = elapsed_ms(start) * 1e6 / lookups;
+
+    // evict and replace entries, then check every key against the maps
+    bool agree = map_total == index_total;
+    std::uniform_int_distribution<int> coord(-side, side);
+    for (int i = 0; i < 100000; i++) {
+        auto& q = queries[rng() % queries.size()];
+        maps[q.level].erase({q.x, q.y});
+        index.erase(packPatchKey(q.level, q.x, q.y));
+        q = {q.level, coord(rng), coord(rng)};
+        maps[q.level][{q.x, q.y}] = i;
+        *index.insert(packPatchKey(q.level, q.x, q.y), i).first = i;
+    }
+    size_t map_entries = 0;
+    for (int level = 0; level < levels; level++) {
+        map_entries += maps[level].size();
+        for (int y = -side; y <= side; y++) {
+            for (int x = -side; x <= side; x++) {
+                auto found = maps[level].find({x, y});
+                auto indexed = index.find(packPatchKey(level, x, y));
+                if ((found == maps[level].end()) != (indexed == nullptr) ||
+                    (indexed != nullptr && *indexed != found->second)) {
+                    agree = false;
+                }
+            }
+        }
+    }
+    agree = agree && map_entries == index.size();
+
+    std::cout << "\npatch index lookups (" << queries.size() << " patches)\n";
+    std::cout << "std::map ns/lookup  PatchIndex ns/lookup  speedup\n";
+    std::cout << map_ns << "             " << index_ns << "              " << map_ns / index_ns << "x\n";
+    std::cout << (agree ? "indexes agree\n" : "INDEXES DISAGREE\n");
+    return agree;
+}
+
+int main() {
+    const int levels = 5;
+    const int patches_per_level = 64;
+
+    std::cout << "noise kernel: " << SimplexNoise1234::batchKernelName() << "\n";
+    std::cout << "level  octaves  reference ms/patch  generatePatch ms/patch  speedup  max height error\n";
+
+    std::vector<float> expected;
+    std::vector<float> actual;
+    bool identical = true;
+    for (int level = 0; level < levels; level++) {
+        PatchStore<float> store(patchLength<float>(grid_size));
+        HeightMap<float> heightMap(grid_size, grid_scale, level, store);
+        const int step = heightMap.level_factor;
+        actual.resize(store.patchLength());
+
+        auto start = Clock::now();
+        for (int i = 0; i < patches_per_level; i++) {
+            reference_patch(heightMap, (i % 8) * step, (i / 8) * step, expected);
+        }
+        double reference_ms = elapsed_ms(start) / patches_per_level;
+
+        start = Clock::now();
+        for (int i = 0; i < patches_per_level; i++) {
+            heightMap.generatePatch((i % 8) * step, (i / 8) * step, actual.data());
+        }
+        double generate_ms = elapsed_ms(start) / patches_per_level;
+
+        // Compare the last patch from each run. Level 0 sums every octave
+        // so must match bit-for-bit; coarser levels drop the octaves finer
+        // than their samples, so report how far that moves the heights.
+        float max_error = 0;
+        for (size_t i = 0; i < expected.size(); i += patch_channels) {
+            max_error = std::max(max_error, std::abs(expected[i] - actual[i]));
+        }
+        if (level == 0 && (expected.size() != patch_values ||
+            std::memcmp(expected.data(), actual.data(), expected.size() * sizeof(float)) != 0)) {
+            identical = false;
+        }
+
+        std::cout << level << "      " << heightMap.patchOctaves() << "        " << reference_ms
+                  << "            " << generate_ms << "                " << reference_ms / generate_ms
+                  << "x  " << max_error << "\n";
+    }
+
+    std::cout << (identical ? "level 0 heights identical\n" : "LEVEL 0 HEIGHTS DIFFER\n");
+
+    // Within a level: generating an area, each patch copies the apron it
+    // shares with neighbours already generated, so after the first row and
+    // column only the grid_size^2 samples of its own are computed.
+    const int extent = 16;
+    std::vector<float> shared, isolated;
+    std::cout << "\nlevel  samples computed/patch  of  shared ms/patch  isolated ms/patch  max height error\n";
+    for (int level = 0; level < levels; level++) {
+        PatchStore<float> store(patchLength<float>(grid_size));
+        double shared_ms = generate_area(store, level, extent, shared);
+        long computed = store.computed_samples;
+
+        PatchStore<float> empty_store(patchLength<float>(grid_size));
+        HeightMap<float> isolatedMap(grid_size, grid_scale, level, empty_store);
+        const int step = isolatedMap.level_factor;
+        actual.resize(store.patchLength());
+        isolated.clear();
+        int patches = 0;
+        auto start = Clock::now();
+        for (int y = 0; y < extent; y += step) {
+            for (int x = 0; x < extent; x += step) {
+                isolatedMap.generatePatch(x, y, actual.data());
+                for (size_t i = 0; i < patch_values; i += patch_channels) {
+                    isolated.push_back(actual[i]);
+                }
+                patches++;
+            }
+        }
+        double isolated_ms = elapsed_ms(start) / patches;
+
+        std::cout << level << "      " << computed / patches << "                    " << patchEdge(grid_size) * patchEdge(grid_size)
+                  << "  " << shared_ms << "         " << isolated_ms << "           "
+                  << max_difference(shared, isolated) << "\n";
+    }
+
+    // Bulk generation: each level's area in one generateRegion() call,
+    // against getPatchFor() patch by patch (with its apron sharing).
+    bool region_identical = true;
+    std::vector<float> by_region;
+    std::cout << "\nlevel  getPatchFor ms/patch  generateRegion ms/patch  speedup  max height error\n";
+    for (int level = 0; level < levels; level++) {
+        PatchStore<float> patch_store(patchLength<float>(grid_size));
+        double patch_ms = generate_area(patch_store, level, extent, shared);
+
+        PatchStore<float> region_store(patchLength<float>(grid_size));
+        HeightMap<float> regionMap(grid_size, grid_scale, level, region_store);
+        auto start = Clock::now();
+        regionMap.generateRegion(0, 0, extent, extent);
+        const int patches = (extent / regionMap.level_factor) * (extent / regionMap.level_factor);
+        double region_ms = elapsed_ms(start) / patches;
+        // read back through the store in the same order
+        generate_area(region_store, level, extent, by_region);
+
+        float max_error = max_difference(shared, by_region);
+        region_identical = region_identical && max_error == 0 && region_store.computed_samples > 0 &&
+                           region_store.generated_patches == patches;
+        std::cout << level << "      " << patch_ms << "              " << region_ms << "                "
+                  << patch_ms / region_ms << "x  " << max_error << "\n";
+    }
+
+    // Cross-level reuse: with level 1 cached, generate level 0 (refining)
+    // and level 2 (decimating) over the same area, against fresh stores.
+    std::vector<float> fresh, reused, unused;
+    std::cout << "\nlevel  from level  fresh ms/patch  reusing ms/patch  max height error\n";
+    for (int level : {0, 2}) {
+        PatchStore<float> empty_store(patchLength<float>(grid_size));
+        double fresh_ms = generate_area(empty_store, level, extent, fresh);
+
+        PatchStore<float> shared_store(patchLength<float>(grid_size));
+        generate_area(shared_store, 1, extent, unused);
+        double reuse_ms = generate_area(shared_store, level, extent, reused);
+
+        std::cout << level << "      1           " << fresh_ms << "        " << reuse_ms
+                  << "          " << max_difference(fresh, reused) << "\n";
+    }
+
+    bool reinserted = pinned_reinsert();
+    bool background = background_generation(extent);
+    bool cached = disk_cache(extent);
+    quantization_error(extent);
+    bool dem = dem_source(extent);
+    bool composed = composed_generators(extent);
+    bool layouts = patch_layouts(extent);
+    bool bounded = height_bounds(extent);
+    bool evicted = layer_eviction();
+    bool layers_shared = shared_layers();
+    bool agree = index_lookups();
+
+    bool passed = identical && region_identical && reinserted && background && cached && dem && composed && layouts && bounded &&
+                  evicted && layers_shared && agree;
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
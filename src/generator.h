@@ -0,0 +1,388 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_GENERATOR_H
+#define TERRAIN_GL_GENERATOR_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#include "height_source.h"
+#include "simplexnoise1234.h"
+
+// Height generators composed at compile time, e.g.
+//
+//   auto mountains = gen::blend(gen::ridged(gen::octaves(gen::simplex(), 6, 1.f / 32, 40)),
+//                               gen::octaves(gen::simplex(), 8, 1.f / 16, 20),
+//                               gen::scaleBias(gen::octaves(gen::simplex(), 2, 1.f / 256, 1), 0.5f, 0.5f));
+//   GeneratorSource source(mountains);
+//
+// Each node is a distinct type holding its inputs by value, so the whole
+// graph is resolved by the compiler and inlines into a single kernel, with
+// no virtual calls below GeneratorSource::sampleRow(). Nodes evaluate
+// chunks of samples at a time, so the noise leaves use the batched SIMD
+// kernels and the working values stay in L1.
+//
+// Every node produces a value and its analytic gradient, at coordinates in
+// grid units; a GeneratorSource's root gives heights in world units.
+namespace gen {
+
+// samples evaluated together by every node
+constexpr int chunk = 64;
+
+struct Samples {
+    float value[chunk];
+    float dx[chunk];
+    float dy[chunk];
+};
+
+// FNV-1a over each node's kind and parameters, identifying a graph for
+// patch cache invalidation
+struct Hash {
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    void mix(const void* data, size_t bytes) {
+        for (size_t i = 0; i < bytes; i++) {
+            hash = (hash ^ static_cast<const unsigned char*>(data)[i]) * 0x100000001b3ull;
+        }
+    }
+    void mix(const char* kind) { mix(kind, std::strlen(kind) + 1); }
+    void mix(float value) { mix(&value, sizeof(value)); }
+};
+
+// Nodes derive from Node<Self>, which is only used to constrain the factory
+// functions below to generator types.
+template<typename Derived>
+struct Node {
+    const Derived& self() const { return static_cast<const Derived&>(*this); }
+};
+
+// Simplex noise in [-1, 1], with a feature size of about one unit
+struct Simplex : Node<Simplex> {
+    void evaluate(const float* x, const float* y, int count, Samples& out) const {
+        SimplexNoise1234::noise(x, y, out.value, out.dx, out.dy, count);
+    }
+    std::pair<float, float> range() const { return {-1, 1}; }
+    void identify(Hash& hash) const { hash.mix("simplex"); }
+};
+
+// fBm: count octaves of source, from the given frequency and amplitude,
+// each lacunarity times the frequency and gain times the amplitude of the
+// last.
+template<typename S>
+struct Octaves : Node<Octaves<S>> {
+    S source;
+    int count;
+    float frequency, amplitude, lacunarity, gain;
+
+    void evaluate(const float* x, const float* y, int n, Samples& out) const {
+        float octave_x[chunk], octave_y[chunk];
+        Samples octave;
+        std::fill_n(out.value, n, 0.f);
+        std::fill_n(out.dx, n, 0.f);
+        std::fill_n(out.dy, n, 0.f);
+        float detail = frequency;
+        float scale = amplitude;
+        for (int o = 0; o < count; o++) {
+            const float slope = scale * detail;
+            for (int i = 0; i < n; i++) {
+                octave_x[i] = x[i] * detail;
+                octave_y[i] = y[i] * detail;
+            }
+            source.evaluate(octave_x, octave_y, n, octave);
+            for (int i = 0; i < n; i++) {
+                out.value[i] += octave.value[i] * scale;
+                out.dx[i] += octave.dx[i] * slope;
+                out.dy[i] += octave.dy[i] * slope;
+            }
+            detail *= lacunarity;
+            scale *= gain;
+        }
+    }
+    std::pair<float, float> range() const {
+        auto [low, high] = source.range();
+        float sum = 0;
+        float scale = amplitude;
+        for (int o = 0; o < count; o++) {
+            sum += scale;
+            scale *= gain;
+        }
+        return {low * sum, high * sum};
+    }
+    void identify(Hash& hash) const {
+        hash.mix("octaves");
+        source.identify(hash);
+        for (float parameter : {float(count), frequency, amplitude, lacunarity, gain}) {
+            hash.mix(parameter);
+        }
+    }
+};
+
+// bounds of |v| for v in [low, high]
+inline std::pair<float, float> absRange(std::pair<float, float> range) {
+    auto [low, high] = range;
+    const float far = std::max(std::abs(low), std::abs(high));
+    const float near = low <= 0 && high >= 0 ? 0 : std::min(std::abs(low), std::abs(high));
+    return {near, far};
+}
+
+// 1 - |source|: sharp crests where the source crosses zero
+template<typename S>
+struct Ridged : Node<Ridged<S>> {
+    S source;
+
+    void evaluate(const float* x, const float* y, int n, Samples& out) const {
+        source.evaluate(x, y, n, out);
+        for (int i = 0; i < n; i++) {
+            const float sign = out.value[i] < 0 ? 1.f : -1.f;
+            out.value[i] = 1 - std::abs(out.value[i]);
+            out.dx[i] *= sign;
+            out.dy[i] *= sign;
+        }
+    }
+    std::pair<float, float> range() const {
+        auto [near, far] = absRange(source.range());
+        return {1 - far, 1 - near};
+    }
+    void identify(Hash& hash) const {
+        hash.mix("ridged");
+        source.identify(hash);
+    }
+};
+
+// 2|source| - 1: rounded hills with creases between them
+template<typename S>
+struct Billow : Node<Billow<S>> {
+    S source;
+
+    void evaluate(const float* x, const float* y, int n, Samples& out) const {
+        source.evaluate(x, y, n, out);
+        for (int i = 0; i < n; i++) {
+            const float sign = out.value[i] < 0 ? -2.f : 2.f;
+            out.value[i] = 2 * std::abs(out.value[i]) - 1;
+            out.dx[i] *= sign;
+            out.dy[i] *= sign;
+        }
+    }
+    std::pair<float, float> range() const {
+        auto [near, far] = absRange(source.range());
+        return {2 * near - 1, 2 * far - 1};
+    }
+    void identify(Hash& hash) const {
+        hash.mix("billow");
+        source.identify(hash);
+    }
+};
+
+// source * scale + bias
+template<typename S>
+struct ScaleBias : Node<ScaleBias<S>> {
+    S source;
+    float scale, bias;
+
+    void evaluate(const float* x, const float* y, int n, Samples& out) const {
+        source.evaluate(x, y, n, out);
+        for (int i = 0; i < n; i++) {
+            out.value[i] = out.value[i] * scale + bias;
+            out.dx[i] *= scale;
+            out.dy[i] *= scale;
+        }
+    }
+    std::pair<float, float> range() const {
+        auto [low, high] = source.range();
+        return {std::min(low * scale, high * scale) + bias, std::max(low * scale, high * scale) + bias};
+    }
+    void identify(Hash& hash) const {
+        hash.mix("scale_bias");
+        source.identify(hash);
+        hash.mix(scale);
+        hash.mix(bias);
+    }
+};
+
+// source sampled at (x, y) displaced by strength times warp, which is
+// sampled twice, at offsets far enough apart to be unrelated, for the x
+// and y displacements. Gradients follow through the displacement.
+template<typename S, typename W>
+struct DomainWarp : Node<DomainWarp<S, W>> {
+    S source;
+    W warp;
+    float strength;
+
+    void evaluate(const float* x, const float* y, int n, Samples& out) const {
+        const float offset_x = 5.2f, offset_y = 1.3f;
+        float shifted_x[chunk], shifted_y[chunk];
+        Samples warp_x, warp_y;
+        warp.evaluate(x, y, n, warp_x);
+        for (int i = 0; i < n; i++) {
+            shifted_x[i] = x[i] + offset_x;
+            shifted_y[i] = y[i] + offset_y;
+        }
+        warp.evaluate(shifted_x, shifted_y, n, warp_y);
+        for (int i = 0; i < n; i++) {
+            shifted_x[i] = x[i] + strength * warp_x.value[i];
+            shifted_y[i] = y[i] + strength * warp_y.value[i];
+        }
+        source.evaluate(shifted_x, shifted_y, n, out);
+        for (int i = 0; i < n; i++) {
+            // gradient of source(u(x, y), v(x, y))
+            const float du_dx = 1 + strength * warp_x.dx[i], du_dy = strength * warp_x.dy[i];
+            const float dv_dx = strength * warp_y.dx[i], dv_dy = 1 + strength * warp_y.dy[i];
+            const float ds_du = out.dx[i], ds_dv = out.dy[i];
+            out.dx[i] = ds_du * du_dx + ds_dv * dv_dx;
+            out.dy[i] = ds_du * du_dy + ds_dv * dv_dy;
+        }
+    }
+    std::pair<float, float> range() const { return source.range(); }
+    void identify(Hash& hash) const {
+        hash.mix("warp");
+        source.identify(hash);
+        warp.identify(hash);
+        hash.mix(strength);
+    }
+};
+
+// the lower (Min) or higher (Max) of two generators at each sample
+template<typename A, typename B, bool Max>
+struct Select : Node<Select<A, B, Max>> {
+    A a;
+    B b;
+
+    void evaluate(const float* x, const float* y, int n, Samples& out) const {
+        Samples other;
+        a.evaluate(x, y, n, out);
+        b.evaluate(x, y, n, other);
+        for (int i = 0; i < n; i++) {
+            if (Max ? other.value[i] > out.value[i] : other.value[i] < out.value[i]) {
+                out.value[i] = other.value[i];
+                out.dx[i] = other.dx[i];
+                out.dy[i] = other.dy[i];
+            }
+        }
+    }
+    std::pair<float, float> range() const {
+        auto [a_low, a_high] = a.range();
+        auto [b_low, b_high] = b.range();
+        return Max ? std::make_pair(std::max(a_low, b_low), std::max(a_high, b_high))
+                   : std::make_pair(std::min(a_low, b_low), std::min(a_high, b_high));
+    }
+    void identify(Hash& hash) const {
+        hash.mix(Max ? "max" : "min");
+        a.identify(hash);
+        b.identify(hash);
+    }
+};
+
+// a where control is 0 or below, b where it's 1 or above, and linearly
+// between them in between
+template<typename A, typename B, typename C>
+struct Blend : Node<Blend<A, B, C>> {
+    A a;
+    B b;
+    C control;
+
+    void evaluate(const float* x, const float* y, int n, Samples& out) const {
+        Samples other, weight;
+        a.evaluate(x, y, n, out);
+        b.evaluate(x, y, n, other);
+        control.evaluate(x, y, n, weight);
+        for (int i = 0; i < n; i++) {
+            const bool clamped = weight.value[i] <= 0 || weight.value[i] >= 1;
+            const float t = std::clamp(weight.value[i], 0.f, 1.f);
+            const float difference = other.value[i] - out.value[i];
+            const float dt_dx = clamped ? 0 : weight.dx[i];
+            const float dt_dy = clamped ? 0 : weight.dy[i];
+            out.dx[i] = out.dx[i] + (other.dx[i] - out.dx[i]) * t + difference * dt_dx;
+            out.dy[i] = out.dy[i] + (other.dy[i] - out.dy[i]) * t + difference * dt_dy;
+            out.value[i] = out.value[i] + difference * t;
+        }
+    }
+    std::pair<float, float> range() const {
+        auto [a_low, a_high] = a.range();
+        auto [b_low, b_high] = b.range();
+        return {std::min(a_low, b_low), std::max(a_high, b_high)};
+    }
+    void identify(Hash& hash) const {
+        hash.mix("blend");
+        a.identify(hash);
+        b.identify(hash);
+        control.identify(hash);
+    }
+};
+
+inline Simplex simplex() { return {}; }
+
+template<typename S>
+Octaves<S> octaves(const Node<S>& source, int count, float frequency, float amplitude,
+                   float lacunarity = 2, float gain = 0.5f) {
+    return {{}, source.self(), count, frequency, amplitude, lacunarity, gain};
+}
+
+template<typename S>
+Ridged<S> ridged(const Node<S>& source) { return {{}, source.self()}; }
+
+template<typename S>
+Billow<S> billow(const Node<S>& source) { return {{}, source.self()}; }
+
+template<typename S>
+ScaleBias<S> scaleBias(const Node<S>& source, float scale, float bias) {
+    return {{}, source.self(), scale, bias};
+}
+
+template<typename S, typename W>
+DomainWarp<S, W> warp(const Node<S>& source, const Node<W>& warp, float strength) {
+    return {{}, source.self(), warp.self(), strength};
+}
+
+template<typename A, typename B>
+Select<A, B, false> min(const Node<A>& a, const Node<B>& b) { return {{}, a.self(), b.self()}; }
+
+template<typename A, typename B>
+Select<A, B, true> max(const Node<A>& a, const Node<B>& b) { return {{}, a.self(), b.self()}; }
+
+template<typename A, typename B, typename C>
+Blend<A, B, C> blend(const Node<A>& a, const Node<B>& b, const Node<C>& control) {
+    return {{}, a.self(), b.self(), control.self()};
+}
+
+}  // namespace gen
+
+// A composed generator as a HeightMap's height source
+template<typename G>
+class GeneratorSource : public HeightSource {
+public:
+    explicit GeneratorSource(const G& generator) : generator(generator) {}
+
+    void sampleRow(float x, float y, float step, int count, float* out) const override {
+        float xs[gen::chunk], ys[gen::chunk];
+        gen::Samples samples;
+        std::fill_n(ys, gen::chunk, y);
+        for (int start = 0; start < count; start += gen::chunk) {
+            const int length = std::min(gen::chunk, count - start);
+            for (int i = 0; i < length; i++) {
+                xs[i] = float(start + i) * step + x;
+            }
+            generator.evaluate(xs, ys, length, samples);
+            for (int i = 0; i < length; i++) {
+                float* sample = &out[(start + i) * 3];
+                sample[0] = samples.value[i];
+                sample[1] = samples.dx[i];
+                sample[2] = samples.dy[i];
+            }
+        }
+    }
+    bool positional() const override { return true; }
+    std::pair<float, float> heightRange() const override { return generator.range(); }
+    uint64_t identity() const override {
+        gen::Hash hash;
+        generator.identify(hash);
+        return hash.hash;
+    }
+private:
+    G generator;
+};
+
+#endif //TERRAIN_GL_GENERATOR_H
@@ -0,0 +1,233 @@
+// terrain_gl
+// @codedstructure 2023
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "height_source.h"
+
+static const size_t page_bytes = 4096;
+
+static bool little_endian() {
+    const uint16_t probe = 1;
+    return *reinterpret_cast<const unsigned char*>(&probe) == 1;
+}
+
+DemHeightSource::DemHeightSource(const std::string& path, Layout layout) :
+    dem(layout)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        std::cerr << "Elevation model " << path << " unavailable: " << strerror(errno) << "\n";
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    file_bytes = file_stat.st_size;
+    modified = file_stat.st_mtime;
+    void* mapped = file_bytes > 0 ? mmap(nullptr, file_bytes, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    // the mapping keeps the file open
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Could not map elevation model " << path << ": " << strerror(errno) << "\n";
+        return;
+    }
+    mapping = static_cast<const unsigned char*>(mapped);
+
+    if (file_bytes >= 2 && mapping[0] == 'P' && mapping[1] == '5' && !readPgmHeader()) {
+        std::cerr << "Could not read PGM header of " << path << "\n";
+    } else if (dem.width == 0 || dem.height == 0 || (dem.sample_bytes != 1 && dem.sample_bytes != 2) ||
+               dem.header_bytes + dem.width * dem.height * dem.sample_bytes > file_bytes) {
+        std::cerr << "Elevation model " << path << " is smaller than its layout\n";
+    } else {
+        if (max_value == 0) {
+            max_value = (1u << (8 * dem.sample_bytes)) - 1;
+        }
+        samples = mapping + dem.header_bytes;
+        // Patches read short runs of many rows, which sequential read-ahead
+        // would only waste I/O on; willNeed() asks for what's needed instead.
+        madvise(const_cast<unsigned char*>(mapping), file_bytes, MADV_RANDOM);
+        return;
+    }
+    munmap(const_cast<unsigned char*>(mapping), file_bytes);
+    mapping = nullptr;
+}
+
+DemHeightSource::~DemHeightSource() {
+    if (mapping != nullptr) {
+        munmap(const_cast<unsigned char*>(mapping), file_bytes);
+    }
+}
+
+// "P5 <width> <height> <maxval>" then a single whitespace character, with
+// comments from # to the end of a line allowed between the fields.
+bool DemHeightSource::readPgmHeader() {
+    size_t at = 2;
+    size_t fields[3];
+    for (auto& field : fields) {
+        while (at < file_bytes && (std::isspace(mapping[at]) || mapping[at] == '#')) {
+            if (mapping[at] == '#') {
+                while (at < file_bytes && mapping[at] != '\n') {
+                    at++;
+                }
+            } else {
+                at++;
+            }
+        }
+        if (at >= file_bytes || !std::isdigit(mapping[at])) {
+            return false;
+        }
+        field = 0;
+        while (at < file_bytes && std::isdigit(mapping[at])) {
+            field = field * 10 + (mapping[at++] - '0');
+        }
+    }
+    if (fields[2] == 0 || fields[2] > 65535 || at >= file_bytes || !std::isspace(mapping[at])) {
+        return false;
+    }
+    dem.width = fields[0];
+    dem.height = fields[1];
+    max_value = fields[2];
+    dem.sample_bytes = max_value < 256 ? 1 : 2;
+    dem.big_endian = true;  // as PGM requires
+    dem.header_bytes = at + 1;
+    return true;
+}
+
+float DemHeightSource::value(ptrdiff_t i, ptrdiff_t j) const {
+    i = std::clamp<ptrdiff_t>(i, 0, dem.width - 1);
+    j = std::clamp<ptrdiff_t>(j, 0, dem.height - 1);
+    const unsigned char* sample = samples + (size_t(j) * dem.width + i) * dem.sample_bytes;
+    if (dem.sample_bytes == 1) {
+        return sample[0];
+    }
+    return dem.big_endian ? sample[0] << 8 | sample[1] : sample[1] << 8 | sample[0];
+}
+
+void DemHeightSource::corner(ptrdiff_t i, ptrdiff_t j, float out[3]) const {
+    out[0] = value(i, j);
+    out[1] = (value(i + 1, j) - value(i - 1, j)) * 0.5f;
+    out[2] = (value(i, j + 1) - value(i, j - 1)) * 0.5f;
+}
+
+void DemHeightSource::sampleRow(float x, float y, float step, int count, float* out) const {
+    // sample positions are kept in double, as models can be far wider than
+    // a float can index precisely
+    const double u0 = (double(x) - dem.origin_x) / dem.spacing;
+    const double v = (double(y) - dem.origin_y) / dem.spacing;
+    const double du = double(step) / dem.spacing;
+    const ptrdiff_t j = std::floor(v);
+    const float fv = float(v - j);
+    const float gradient_scale = dem.height_scale / dem.spacing;
+
+    // Rows landing on whole samples of a native 16-bit model, as when a
+    // level's spacing matches the model's, are read straight from the
+    // mapping with no interpolation or clamping.
+    const ptrdiff_t i0 = ptrdiff_t(std::floor(u0));
+    if (dem.sample_bytes == 2 && dem.big_endian != little_endian() && fv == 0 && du == 1 && u0 == i0 &&
+        i0 >= 1 && i0 + count < ptrdiff_t(dem.width) && j >= 1 && j + 1 < ptrdiff_t(dem.height)) {
+        auto row = [this](ptrdiff_t row_j) {
+            return reinterpret_cast<const uint16_t*>(samples + size_t(row_j) * dem.width * 2);
+        };
+        const uint16_t* above = row(j - 1);
+        const uint16_t* centre = row(j);
+        const uint16_t* below = row(j + 1);
+        for (int n = 0; n < count; n++) {
+            const ptrdiff_t i = i0 + n;
+            out[n * 3] = dem.height_offset + centre[i] * dem.height_scale;
+            out[n * 3 + 1] = (float(centre[i + 1]) - float(centre[i - 1])) * 0.5f * gradient_scale;
+            out[n * 3 + 2] = (float(below[i]) - float(above[i])) * 0.5f * gradient_scale;
+        }
+        return;
+    }
+
+    for (int n = 0; n < count; n++) {
+        const double u = u0 + n * du;
+        const ptrdiff_t i = std::floor(u);
+        const float fu = float(u - i);
+        float c00[3], c10[3], c01[3], c11[3];
+        corner(i, j, c00);
+        corner(i + 1, j, c10);
+        corner(i, j + 1, c01);
+        corner(i + 1, j + 1, c11);
+        float blended[3];
+        for (int channel = 0; channel < 3; channel++) {
+            blended[channel] = (c00[channel] * (1 - fu) + c10[channel] * fu) * (1 - fv) +
+                               (c01[channel] * (1 - fu) + c11[channel] * fu) * fv;
+        }
+        out[n * 3] = dem.height_offset + blended[0] * dem.height_scale;
+        out[n * 3 + 1] = blended[1] * gradient_scale;
+        out[n * 3 + 2] = blended[2] * gradient_scale;
+    }
+}
+
+void DemHeightSource::willNeed(float x, float y, float step, int columns, int rows) const {
+    if (mapping == nullptr) {
+        return;
+    }
+    // Interpolation and gradients reach one sample beyond the lattice on
+    // the low side and two on the high side.
+    const double u0 = (double(x) - dem.origin_x) / dem.spacing;
+    const double v0 = (double(y) - dem.origin_y) / dem.spacing;
+    const double du = double(step) / dem.spacing;
+    const auto first_i = size_t(std::clamp<double>(std::floor(u0) - 1, 0, dem.width - 1));
+    const auto last_i = size_t(std::clamp<double>(std::floor(u0 + (columns - 1) * du) + 2, 0, dem.width - 1));
+    const size_t row_bytes = dem.width * dem.sample_bytes;
+
+    // one byte range per model row needed, merged where they meet so a
+    // dense window becomes a single call
+    uintptr_t start = 0, end = 0;
+    auto advise = [&] {
+        if (end > start) {
+            madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED);
+        }
+    };
+    ptrdiff_t previous_j = -1;
+    for (int row = 0; row < rows; row++) {
+        const double v = v0 + row * du;
+        const auto first_j = ptrdiff_t(std::clamp<double>(std::floor(v) - 1, 0, dem.height - 1));
+        const auto last_j = ptrdiff_t(std::clamp<double>(std::floor(v) + 2, 0, dem.height - 1));
+        for (ptrdiff_t j = std::max(first_j, previous_j + 1); j <= last_j; j++) {
+            const auto row_start = reinterpret_cast<uintptr_t>(samples + j * row_bytes + first_i * dem.sample_bytes);
+            const auto row_end = reinterpret_cast<uintptr_t>(samples + j * row_bytes + (last_i + 1) * dem.sample_bytes);
+            const uintptr_t page_start = row_start / page_bytes * page_bytes;
+            if (page_start > end) {
+                advise();
+                start = page_start;
+            }
+            end = row_end;
+        }
+        previous_j = std::max(previous_j, last_j);
+    }
+    advise();
+}
+
+std::pair<float, float> DemHeightSource::heightRange() const {
+    return {dem.height_offset, dem.height_offset + max_value * dem.height_scale};
+}
+
+uint64_t DemHeightSource::identity() const {
+    uint64_t hash = 0xcbf29ce484222325ull;  // FNV-1a
+    auto mix = [&hash](const void* data, size_t bytes) {
+        for (size_t i = 0; i < bytes; i++) {
+            hash = (hash ^ static_cast<const unsigned char*>(data)[i]) * 0x100000001b3ull;
+        }
+    };
+    const uint64_t file[] = {file_bytes, uint64_t(modified), dem.width, dem.height, dem.header_bytes,
+                             uint64_t(dem.sample_bytes), dem.big_endian};
+    const float placement[] = {dem.origin_x, dem.origin_y, dem.spacing, dem.height_offset, dem.height_scale};
+    mix(file, sizeof(file));
+    mix(placement, sizeof(placement));
+    return hash;
+}
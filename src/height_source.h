@@ -0,0 +1,83 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_HEIGHT_SOURCE_H
+#define TERRAIN_GL_HEIGHT_SOURCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+
+// Where a HeightMap's heights come from, in place of its fBm noise.
+// Coordinates are in grid units; heights are in world units, and gradients
+// in world units per grid unit. Sources are shared by every level and the
+// worker threads, so must be safe to sample concurrently.
+class HeightSource {
+public:
+    virtual ~HeightSource() = default;
+
+    // Samples count points along a row, from (x, y) in steps of step along
+    // x, writing height, dh/dx and dh/dy interleaved to out.
+    virtual void sampleRow(float x, float y, float step, int count, float* out) const = 0;
+    // Hints that the rows x columns lattice from (x, y) at spacing step is
+    // about to be sampled.
+    virtual void willNeed(float /*x*/, float /*y*/, float /*step*/, int /*columns*/, int /*rows*/) const {}
+    // Whether heights depend on position alone, not the step sampled at,
+    // so samples can be shared between patches and levels as noise is.
+    virtual bool positional() const { return false; }
+    // bounds every height lies within
+    virtual std::pair<float, float> heightRange() const = 0;
+    // identifies the data, for patch cache invalidation
+    virtual uint64_t identity() const = 0;
+};
+
+// A digital elevation model streamed from a raw or binary PGM (P5) file of
+// 8 or 16-bit samples. The file is mapped rather than read, so only the
+// pages patches actually cover are ever loaded, and any size of file can
+// be used. Heights are interpolated bilinearly between samples; coarse
+// levels point sample the model rather than filtering it.
+class DemHeightSource : public HeightSource {
+public:
+    struct Layout {
+        size_t width = 0, height = 0;  // in samples
+        size_t header_bytes = 0;
+        int sample_bytes = 2;
+        bool big_endian = false;
+        float origin_x = 0, origin_y = 0;  // grid position of the first sample
+        float spacing = 1.f / 64;  // grid units between samples
+        float height_offset = 0, height_scale = 1;  // world height of each sample value
+    };
+
+    // Raw files need their layout given in full; for PGM files the header
+    // supplies the size, sample width and byte order.
+    DemHeightSource(const std::string& path, Layout layout);
+    DemHeightSource(const DemHeightSource&) = delete;
+    DemHeightSource& operator=(const DemHeightSource&) = delete;
+    ~DemHeightSource() override;
+
+    bool isOpen() const { return mapping != nullptr; }
+    const Layout& layout() const { return dem; }
+
+    void sampleRow(float x, float y, float step, int count, float* out) const override;
+    void willNeed(float x, float y, float step, int columns, int rows) const override;
+    // coarse levels point sample the same surface
+    bool positional() const override { return true; }
+    std::pair<float, float> heightRange() const override;
+    uint64_t identity() const override;
+private:
+    bool readPgmHeader();
+    // sample value at (i, j), clamped to the edges
+    float value(ptrdiff_t i, ptrdiff_t j) const;
+    // value and gradient (per sample) at sample (i, j), from central differences
+    void corner(ptrdiff_t i, ptrdiff_t j, float out[3]) const;
+
+    Layout dem;
+    unsigned max_value = 0;
+    size_t file_bytes = 0;
+    int64_t modified = 0;
+    const unsigned char* mapping = nullptr;
+    const unsigned char* samples = nullptr;
+};
+
+#endif //TERRAIN_GL_HEIGHT_SOURCE_H
@@ -1,13 +1,16 @@
 // terrain_gl
 // @codedstructure 2023
 
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <type_traits>
 #include <vector>
-#include <GL/glew.h>
-#define GLFW_INCLUDE_NONE
-#define GL_SILENCE_DEPRECATION
-#include <GLFW/glfw3.h>
 #include <cmath>
 #include <iostream>
+#include <limits>
 
 #include "heightmap.h"
 #include "simplexnoise1234.h"
@@ -17,11 +20,31 @@
 // Ginsburg & Purnomo, 2014 Pearson Education Ltd.
 
 template<typename T>
-HeightMap<T>::HeightMap(int size, int grid_scale, int level) :
+HeightMap<T>::HeightMap(int size, int grid_scale, int level, PatchStore<T>& store, OctaveFill octave_fill,
+                        PatchWorkers<T>* workers, const HeightSource* source) :
     size(size),
     grid_scale(grid_scale),
-    level_factor(1 << level)
+    level_factor(1 << level),
+    level(level),
+    octave_fill(octave_fill),
+    store(store),
+    workers(workers),
+    source(source)
 {
+    // fBm octave amplitudes and frequencies, shared by heightAt() and
+    // generatePatch() so level 0 patches match heightAt() exactly.
+    float scale = 30;
+    float detail = 1. / 16;
+    for (int octave = 0; octave < octaves; octave++) {
+        octave_scale[octave] = scale;
+        octave_detail[octave] = detail;
+        octave_slope[octave] = scale * detail;
+        scale /= 2;
+        detail *= 2;
+    }
+
+    patch_octaves = levelOctaves(level, patch_scale);
+
     // vertices, with initial height (y) set to 0.
     // this will make a grid of (n+1) * (n+1) vertices, so there are n*n
     // cells, each with two triangles.
@@ -92,6 +115,43 @@ HeightMap<T>::HeightMap(int size, int grid_scale, int level) :
      }
 }
 
+template<typename T>
+uint64_t HeightMap<T>::generatorHash() const {
+    // bump whenever generatePatch() changes what it writes
+    const uint32_t generator_version = 1;
+
+    uint64_t hash = 0xcbf29ce484222325ull;  // FNV-1a
+    auto mix = [&hash](const void* data, size_t bytes) {
+        for (size_t i = 0; i < bytes; i++) {
+            hash = (hash ^ static_cast<const unsigned char*>(data)[i]) * 0x100000001b3ull;
+        }
+    };
+    const uint32_t parameters[] = {generator_version, uint32_t(sizeof(T)), uint32_t(size), uint32_t(grid_scale),
+                                   uint32_t(patch_channels), uint32_t(octaves), uint32_t(octave_fill),
+                                   uint32_t(store.layout())};
+    mix(parameters, sizeof(parameters));
+    mix(octave_scale, sizeof(octave_scale));
+    mix(octave_detail, sizeof(octave_detail));
+    if (source != nullptr) {
+        const uint64_t source_identity = source->identity();
+        mix(&source_identity, sizeof(source_identity));
+    }
+    return hash;
+}
+
+template<typename T>
+std::pair<float, float> HeightMap<T>::heightRange() const {
+    if (source != nullptr) {
+        return source->heightRange();
+    }
+    // simplex noise lies within [-1, 1]
+    float amplitude = 0;
+    for (int octave = 0; octave < octaves; octave++) {
+        amplitude += patch_scale[octave];
+    }
+    return {finishHeight(-amplitude), finishHeight(amplitude)};
+}
+
 template<typename T>
 std::pair<int, int> HeightMap<T>::getPatchCoords(float x, float y) {
     x = floor(float(x) / level_factor) * level_factor;
@@ -100,59 +160,649 @@ std::pair<int, int> HeightMap<T>::getPatchCoords(float x, float y) {
     return {x, y};
 }
 
+// Working buffers for generatePatch(), kept per thread so generating a
+// patch doesn't allocate once they've grown to size.
+template<typename T>
+struct HeightMap<T>::Scratch {
+    std::vector<char> filled;
+    std::vector<int> indices;
+    std::vector<std::pair<int, int>> columns, rows;
+    std::vector<float> xs, ys, value, dx, dy;
+    std::vector<float> patch;  // values before they're encoded as T
+
+    // sample positions for the listed indices, with zeroed accumulators
+    void prepare(int edge, int low, float step_size, int grid_x, int grid_y) {
+        const size_t count = indices.size();
+        xs.resize(count);
+        ys.resize(count);
+        value.assign(count, 0.f);
+        dx.assign(count, 0.f);
+        dy.assign(count, 0.f);
+        for (size_t n = 0; n < count; n++) {
+            xs[n] = float(indices[n] % edge + low) * step_size + grid_x;
+            ys[n] = float(indices[n] / edge + low) * step_size + grid_y;
+        }
+    }
+};
+
 template<typename T>
-std::vector<T>& HeightMap<T>::getPatchFor(float fx, float fy) {
+T* HeightMap<T>::getPatchFor(float fx, float fy) {
     //std::cout << "getPatchFor("<<fx<<","<<fy<<")\n";
     auto [x, y] = getPatchCoords(fx, fy);
-    auto key = std::make_pair(x, y);
-    auto found_patch = patches.find(key);
-    if (found_patch != patches.end()) {
-        return found_patch->second;
+    auto found_patch = store.find(level, x, y);
+    if (found_patch != nullptr) {
+        store.hits++;
+        return found_patch;
+    }
+    store.misses++;
+    return buildPatch(x, y);
+}
+
+template<typename T>
+T* HeightMap<T>::requestPatch(int x, int y, float priority) {
+    auto found_patch = store.acquire(level, x, y);
+    if (found_patch != nullptr) {
+        store.hits++;
+        return found_patch;
+    }
+    store.misses++;
+    if (workers == nullptr) {
+        buildPatch(x, y);
+        return store.acquire(level, x, y);
+    }
+    workers->request(*this, x, y, priority);
+    return nullptr;
+}
+
+template<typename T>
+void HeightMap<T>::prefetchPatch(int x, int y, float priority) {
+    if (workers != nullptr && store.find(level, x, y) == nullptr) {
+        workers->request(*this, x, y, priority);
+    }
+}
+
+template<typename T>
+T* HeightMap<T>::buildPatch(int x, int y) {
+    // a patch saved by an earlier session needs no noise at all
+    auto loaded = store.load(level, x, y);
+    if (loaded != nullptr) {
+        return loaded;
+    }
+
+    // generated in place, in a buffer from the store's pool
+    auto handle = store.allocate();
+    generatePatch(x, y, store.data(handle));
+    return store.insert(level, x, y, handle);
+}
+
+template<typename T>
+int HeightMap<T>::levelOctaves(int for_level, float amplitude[octaves]) const {
+    // Octaves whose noise cells are less than two samples across would
+    // only alias, so patches stop short of them. Level 0 keeps all ten.
+    const float sample_spacing = float(1 << for_level) / size;
+    int count = 1;
+    while (count < octaves && octave_detail[count] * sample_spacing <= 0.5f) {
+        count++;
+    }
+    float dropped_energy = 0;
+    for (int octave = 0; octave < octaves; octave++) {
+        amplitude[octave] = octave < count ? octave_scale[octave] : 0;
+        if (octave >= count) {
+            dropped_energy += octave_scale[octave] * octave_scale[octave];
+        }
+    }
+    if (octave_fill == OctaveFill::PreserveEnergy && dropped_energy > 0) {
+        float& finest = amplitude[count - 1];
+        finest = std::sqrt(finest * finest + dropped_energy);
+    }
+    return count;
+}
+
+template<typename T>
+void HeightMap<T>::accumulateOctaves(const float* x, const float* y, int count, const float amplitude[octaves],
+                                     float* value, float* dx, float* dy) const {
+    // Samples are processed in chunks small enough for the scaled
+    // coordinates and noise results to stay in L1 across all the octaves.
+    const int chunk = 256;
+    float octave_x[chunk], octave_y[chunk];
+    float noise[chunk], noise_dx[chunk], noise_dy[chunk];
+    for (int start = 0; start < count; start += chunk) {
+        const int length = std::min(chunk, count - start);
+        for (int octave = 0; octave < octaves; octave++) {
+            if (amplitude[octave] == 0) {
+                continue;
+            }
+            const float detail = octave_detail[octave];
+            const float scale = amplitude[octave];
+            const float slope = scale * detail;
+            for (int i = 0; i < length; i++) {
+                octave_x[i] = x[start + i] * detail;
+                octave_y[i] = y[start + i] * detail;
+            }
+            SimplexNoise1234::noise(octave_x, octave_y, noise, noise_dx, noise_dy, length);
+            for (int i = 0; i < length; i++) {
+                value[start + i] += noise[i] * scale;
+                dx[start + i] += noise_dx[i] * slope;
+                dy[start + i] += noise_dy[i] * slope;
+            }
+        }
+    }
+}
+
+template<typename T>
+void HeightMap<T>::reuseSamples(int source_level, int grid_x, int grid_y, float* target, Scratch& scratch) {
+    const int low = -size / 8;
+    const int high = size + size / 8;
+    const int edge = high - low + 1;
+    const int source_factor = 1 << source_level;
+    const float step_size = float(level_factor) / size;
+
+    // Map this patch's sample columns and rows onto the source level's
+    // lattice, as (local index, source lattice index) pairs. Every sample
+    // lands on the same or a finer lattice; only every other one on a
+    // coarser lattice.
+    auto map_axis = [&](int base, std::vector<std::pair<int, int>>& mapped) {
+        mapped.clear();
+        for (int i = 0; i < edge; i++) {
+            const int lattice = base + low + i;
+            if (source_factor < level_factor) {
+                mapped.emplace_back(i, lattice * (level_factor / source_factor));
+            } else if (lattice % (source_factor / level_factor) == 0) {
+                mapped.emplace_back(i, lattice / (source_factor / level_factor));
+            }
+        }
+    };
+    auto& columns = scratch.columns;
+    auto& rows = scratch.rows;
+    map_axis(grid_x * size / level_factor, columns);
+    map_axis(grid_y * size / level_factor, rows);
+
+    // Source patch n has its origin at lattice index n * size
+    auto floor_div = [](int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); };
+    const int first_x = floor_div(columns.front().second - high, size);
+    const int last_x = floor_div(columns.back().second - low, size);
+    const int first_y = floor_div(rows.front().second - high, size);
+    const int last_y = floor_div(rows.back().second - low, size);
+
+    // Copy from every cached source patch that covers some of those samples
+    // The mapped lattice indices increase along each axis, so the part of
+    // a source patch's range [origin + low, origin + high] they fall in is
+    // a contiguous run.
+    auto overlap = [&](const std::vector<std::pair<int, int>>& mapped, int origin) {
+        auto first = std::lower_bound(mapped.begin(), mapped.end(), origin + low,
+                                      [](const std::pair<int, int>& m, int v) { return m.second < v; });
+        auto last = std::upper_bound(mapped.begin(), mapped.end(), origin + high,
+                                     [](int v, const std::pair<int, int>& m) { return v < m.second; });
+        return std::make_pair(first, last);
+    };
+
+    auto& filled = scratch.filled;
+    auto& copied = scratch.indices;
+    copied.clear();
+    for (int patch_y = first_y; patch_y <= last_y; patch_y++) {
+        for (int patch_x = first_x; patch_x <= last_x; patch_x++) {
+            // pinned so no other thread can evict it while it's being read
+            const T* source = store.acquire(source_level, patch_x * source_factor, patch_y * source_factor);
+            if (source == nullptr) {
+                continue;
+            }
+            const auto quantization = patchQuantization(source, size_t(edge) * edge * patch_channels);
+            const int origin_x = patch_x * size;
+            const int origin_y = patch_y * size;
+            auto [column_begin, column_end] = overlap(columns, origin_x);
+            auto [row_begin, row_end] = overlap(rows, origin_y);
+            const PatchLayout layout = store.layout();
+            for (auto row = row_begin; row != row_end; ++row) {
+                const int source_j = row->second - origin_y - low;
+                for (auto column = column_begin; column != column_end; ++column) {
+                    const int idx = row->first * edge + column->first;
+                    if (filled[idx]) {
+                        continue;
+                    }
+                    const int source_i = column->second - origin_x - low;
+                    const T* from = &source[patchSampleIndex(layout, edge, source_i, source_j) * patch_channels];
+                    for (int channel = 0; channel < patch_channels; channel++) {
+                        target[idx * patch_channels + channel] = decodeValue(from, quantization, channel);
+                    }
+                    filled[idx] = 1;
+                    copied.push_back(idx);
+                }
+            }
+            store.unpin(packPatchKey(source_level, patch_x * source_factor, patch_y * source_factor));
+        }
+    }
+    // copies from a height source need no correction
+    store.reused_samples += copied.size();
+    if (copied.empty() || source != nullptr) {
+        return;
     }
 
-    auto new_patch = new std::vector<T>;
-    generatePatch(x, y, *new_patch);
-    patches.emplace(key, *new_patch);
+    // The copies hold the source level's octaves, so correct them by just
+    // the octaves in which the two levels differ.
+    float source_scale[octaves];
+    levelOctaves(source_level, source_scale);
+    float delta[octaves];
+    bool differs = false;
+    for (int octave = 0; octave < octaves; octave++) {
+        delta[octave] = patch_scale[octave] - source_scale[octave];
+        differs = differs || delta[octave] != 0;
+    }
+    if (!differs) {
+        return;
+    }
 
-    return *new_patch;
+    const int count = copied.size();
+    scratch.prepare(edge, low, step_size, grid_x, grid_y);
+    accumulateOctaves(scratch.xs.data(), scratch.ys.data(), count, delta,
+                      scratch.value.data(), scratch.dx.data(), scratch.dy.data());
+    for (int n = 0; n < count; n++) {
+        float* out = &target[copied[n] * patch_channels];
+        out[0] += scratch.value[n] * heightScale();
+        out[1] += finishGradient(scratch.dx[n]);
+        out[2] += finishGradient(scratch.dy[n]);
+    }
 }
 
 template<typename T>
-void HeightMap<T>::generatePatch(int grid_x, int grid_y, std::vector<T>& target) {
-    std::cout << "generatePatch("<<grid_x<<","<<grid_y<<")\n";
+void HeightMap<T>::generatePatch(int grid_x, int grid_y, T* target) {
     // size must be a multiple of 8 so these are integers
-    auto low = -size * 0.125;
-    auto high = size * 1.125;
-    auto step_size = float(level_factor) / size;
+    const int low = -size / 8;
+    const int high = size + size / 8;
+    const int edge = high - low + 1;
+    const float step_size = float(level_factor) / size;
+
+    // target holds patchLength<T>(size) values
+    static thread_local Scratch scratch;
+    const size_t values = size_t(edge) * edge * patch_channels;
+
+    // Generated as row-major floats: straight into row-major float patches,
+    // otherwise into scratch to be encoded at the end.
+    float* work;
+    if constexpr (std::is_same_v<T, float>) {
+        work = target;
+    }
+    if (!std::is_same_v<T, float> || store.layout() != PatchLayout::RowMajor) {
+        scratch.patch.resize(values);
+        work = scratch.patch.data();
+    }
+
+    // Samples already generated are reused first: the apron shared with
+    // neighbouring patches on this level (copied exactly), then samples
+    // from the levels either side.
+    scratch.filled.assign(edge * edge, 0);
+    if (source == nullptr || source->positional()) {
+        for (int source_level : {level, level - 1, level + 1}) {
+            if (source_level >= 0) {
+                reuseSamples(source_level, grid_x, grid_y, work, scratch);
+            }
+        }
+    }
+
+    // A height source is read a run of missing samples along each row at a
+    // time.
+    if (source != nullptr) {
+        source->willNeed(grid_x + low * step_size, grid_y + low * step_size, step_size, edge, edge);
+        int computed = 0;
+        for (int row = 0; row < edge; row++) {
+            const char* filled = &scratch.filled[size_t(row) * edge];
+            for (int begin = 0, end; begin < edge; begin = end) {
+                for (end = begin + 1; end < edge && !filled[end] == !filled[begin]; end++) {
+                }
+                if (!filled[begin]) {
+                    sampleSource(float(begin + low) * step_size + grid_x, float(row + low) * step_size + grid_y,
+                                 step_size, end - begin, &work[(size_t(row) * edge + begin) * patch_channels]);
+                    computed += end - begin;
+                }
+            }
+        }
+        store.computed_samples += computed;
+        encodePatch(work, edge, store.layout(), target);
+        return;
+    }
+
+    // The rest are evaluated from scratch, in structure-of-arrays form
+    auto& missing = scratch.indices;
+    missing.clear();
+    for (int idx = 0; idx < edge * edge; idx++) {
+        if (!scratch.filled[idx]) {
+            missing.push_back(idx);
+        }
+    }
+    const int count = missing.size();
+    scratch.prepare(edge, low, step_size, grid_x, grid_y);
+    accumulateOctaves(scratch.xs.data(), scratch.ys.data(), count, patch_scale,
+                      scratch.value.data(), scratch.dx.data(), scratch.dy.data());
+    store.computed_samples += count;
+
+    for (int n = 0; n < count; n++) {
+        float* out = &work[missing[n] * patch_channels];
+        out[0] = finishHeight(scratch.value[n]);
+        out[1] = finishGradient(scratch.dx[n]);
+        out[2] = finishGradient(scratch.dy[n]);
+    }
+    encodePatch(work, edge, store.layout(), target);
+}
+
+// Runs a body over [0, count) split between thread_count threads, which
+// are started once and reused for every call; the calling thread takes the
+// first share.
+class RegionThreads {
+public:
+    explicit RegionThreads(int thread_count) : thread_count(thread_count) {
+        for (int t = 1; t < thread_count; t++) {
+            threads.emplace_back(&RegionThreads::work, this, t);
+        }
+    }
+    ~RegionThreads() {
+        {
+            std::lock_guard lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    // body(thread, begin, end), where thread is in [0, thread_count)
+    void run(int count, std::function<void(int, int, int)> run_body) {
+        {
+            std::lock_guard lock(mutex);
+            body = std::move(run_body);
+            body_count = count;
+            running = int(threads.size());
+            generation++;
+        }
+        wake.notify_all();
+        share(0);
+        std::unique_lock lock(mutex);
+        done.wait(lock, [this] { return running == 0; });
+    }
+private:
+    void share(int t) {
+        const int begin = body_count * t / thread_count;
+        const int end = body_count * (t + 1) / thread_count;
+        if (begin < end) {
+            body(t, begin, end);
+        }
+    }
+    void work(int t) {
+        long seen = 0;
+        std::unique_lock lock(mutex);
+        while (true) {
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+            lock.unlock();
+            share(t);
+            lock.lock();
+            if (--running == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    int thread_count;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    std::function<void(int, int, int)> body;
+    int body_count = 0;
+    int running = 0;
+    long generation = 0;
+    bool stopping = false;
+};
+
+template<typename T>
+void HeightMap<T>::generateRegion(int x0, int y0, int x1, int y1, int thread_count) {
+    // below this many patches, generating them one at a time (reusing their
+    // neighbours' aprons) is quicker than setting up the bands
+    const int min_region_patches = 8;
+    const int low = -size / 8;
+    const int edge = patchEdge(size);
+    const int apron_rows = edge - size;
+    const float step_size = float(level_factor) / size;
+    const size_t values = size_t(edge) * edge * patch_channels;
+
+    auto [first_x, first_y] = getPatchCoords(x0, y0);
+    const int columns = (x1 - first_x + level_factor - 1) / level_factor;
+    const int rows = (y1 - first_y + level_factor - 1) / level_factor;
+    if (columns <= 0 || rows <= 0) {
+        return;
+    }
+    if (columns * rows < min_region_patches) {
+        for (int y = first_y; y < first_y + rows * level_factor; y += level_factor) {
+            for (int x = first_x; x < first_x + columns * level_factor; x += level_factor) {
+                if (store.find(level, x, y) == nullptr) {
+                    buildPatch(x, y);
+                }
+            }
+        }
+        return;
+    }
+    if (thread_count <= 0) {
+        thread_count = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    RegionThreads threads(thread_count);
+
+    // The region is generated a band of patches at a time, as full-width
+    // rows of samples which the band's patches are then cut out of. Each
+    // band starts with the apron rows it shares with the band before.
+    const int width = (columns - 1) * size + edge;
+    std::vector<float> band(size_t(edge) * width * patch_channels);
+    std::vector<T*> targets(columns);
+    std::vector<std::pair<PatchKey, typename PatchStore<T>::Handle>> generated;
+    // per thread, kept for every band
+    struct RowScratch {
+        std::vector<float> xs, ys, value, dx, dy, patch;
+    };
+    std::vector<RowScratch> scratch(thread_count);
+    for (auto& thread_scratch : scratch) {
+        thread_scratch.xs.resize(width);
+        for (int i = 0; i < width; i++) {
+            thread_scratch.xs[i] = float(i + low) * step_size + first_x;
+        }
+        thread_scratch.ys.resize(width);
+        thread_scratch.value.resize(width);
+        thread_scratch.dx.resize(width);
+        thread_scratch.dy.resize(width);
+        thread_scratch.patch.resize(values);
+    }
+    for (int band_y = 0; band_y < rows; band_y++) {
+        const int grid_y = first_y + band_y * level_factor;
+        int first_row = 0;
+        if (band_y > 0) {
+            std::copy(band.end() - size_t(apron_rows) * width * patch_channels, band.end(), band.begin());
+            first_row = apron_rows;
+        }
+
+        if (source != nullptr) {
+            const float x = float(low) * step_size + first_x;
+            source->willNeed(x, float(first_row + low) * step_size + grid_y, step_size, width, edge - first_row);
+        }
+        threads.run(edge - first_row, [&](int thread, int begin, int end) {
+            if (source != nullptr) {
+                for (int row = first_row + begin; row < first_row + end; row++) {
+                    sampleSource(float(low) * step_size + first_x, float(row + low) * step_size + grid_y, step_size,
+                                 width, &band[size_t(row) * width * patch_channels]);
+                }
+                return;
+            }
+            auto& [xs, ys, value, dx, dy, patch] = scratch[thread];
+            for (int row = first_row + begin; row < first_row + end; row++) {
+                std::fill(ys.begin(), ys.end(), float(row + low) * step_size + grid_y);
+                std::fill(value.begin(), value.end(), 0.f);
+                std::fill(dx.begin(), dx.end(), 0.f);
+                std::fill(dy.begin(), dy.end(), 0.f);
+                accumulateOctaves(xs.data(), ys.data(), width, patch_scale, value.data(), dx.data(), dy.data());
+                float* out = &band[size_t(row) * width * patch_channels];
+                for (int i = 0; i < width; i++) {
+                    out[i * patch_channels] = finishHeight(value[i]);
+                    out[i * patch_channels + 1] = finishGradient(dx[i]);
+                    out[i * patch_channels + 2] = finishGradient(dy[i]);
+                }
+            }
+        });
+        store.computed_samples += long(edge - first_row) * width;
 
-    for (int y = low; y <= high; y++) {
-        for (int x = low; x <= high; x++) {
+        // Patches already stored are left as they are, though the band's
+        // samples are still needed for the apron of the band after.
+        generated.clear();
+        for (int column = 0; column < columns; column++) {
+            const int grid_x = first_x + column * level_factor;
+            targets[column] = nullptr;
+            if (store.find(level, grid_x, grid_y) == nullptr) {
+                auto handle = store.allocate();
+                targets[column] = store.data(handle);
+                generated.emplace_back(packPatchKey(level, grid_x, grid_y), handle);
+            }
+        }
+        threads.run(columns, [&](int thread, int begin, int end) {
+            auto& patch = scratch[thread].patch;
+            for (int column = begin; column < end; column++) {
+                if (targets[column] == nullptr) {
+                    continue;
+                }
+                for (int row = 0; row < edge; row++) {
+                    auto from = band.begin() + (size_t(row) * width + column * size) * patch_channels;
+                    std::copy(from, from + edge * patch_channels, &patch[size_t(row) * edge * patch_channels]);
+                }
+                encodePatch(patch.data(), edge, store.layout(), targets[column]);
+            }
+        });
+        // published band by band, so only one band's buffers are held at once
+        store.insertAll(generated);
+    }
+}
 
-            float fx = float(x) * step_size + grid_x;
-            float fy = float(y) * step_size + grid_y;
+template<typename T>
+bool HeightMap<T>::storedHeightAt(float x, float y, float& height) {
+    auto [patch_x, patch_y] = getPatchCoords(x, y);
+    const T* patch = store.acquire(level, patch_x, patch_y);
+    if (patch == nullptr) {
+        return false;
+    }
+    const int low = -size / 8;
+    const int edge = patchEdge(size);
+    const auto quantization = patchQuantization(patch, size_t(edge) * edge * patch_channels);
+
+    // sample coordinates within the patch, which includes its apron
+    const float u = (x - patch_x) * size / level_factor - low;
+    const float v = (y - patch_y) * size / level_factor - low;
+    const int i = std::min(int(u), edge - 2);
+    const int j = std::min(int(v), edge - 2);
+    const float fu = u - i;
+    const float fv = v - j;
+    auto sample = [&](int si, int sj) {
+        return decodeValue(&patch[patchSampleIndex(store.layout(), edge, si, sj) * patch_channels], quantization, 0);
+    };
+    height = (sample(i, j) * (1 - fu) + sample(i + 1, j) * fu) * (1 - fv) +
+             (sample(i, j + 1) * (1 - fu) + sample(i + 1, j + 1) * fu) * fv;
+
+    store.unpin(packPatchKey(level, patch_x, patch_y));
+    return true;
+}
+
+template<typename T>
+bool HeightMap<T>::heightBounds(float x0, float y0, float x1, float y1, float& low, float& high) {
+    const int blocks = patchBoundsBlocks(size);
+    const int levels = patchBoundsLevels(size);
+    auto [first_x, first_y] = getPatchCoords(x0, y0);
+    auto [last_x, last_y] = getPatchCoords(x1, y1);
+    // the patch before shares the edge a rectangle ends on
+    if (last_x > first_x && last_x == x1) {
+        last_x -= level_factor;
+    }
+    if (last_y > first_y && last_y == y1) {
+        last_y -= level_factor;
+    }
 
-            T value = heightAt(fx, fy);
-            target.push_back(value);
+    low = std::numeric_limits<float>::max();
+    high = std::numeric_limits<float>::lowest();
+    for (int patch_y = first_y; patch_y <= last_y; patch_y += level_factor) {
+        for (int patch_x = first_x; patch_x <= last_x; patch_x += level_factor) {
+            const T* patch = store.acquire(level, patch_x, patch_y);
+            if (patch == nullptr) {
+                return false;
+            }
+            // the finest blocks overlapped, coarsened until there are at
+            // most 2 x 2 of them to read
+            auto block = [&](float v, int origin) {
+                return std::clamp(int(std::floor((v - origin) * blocks / level_factor)), 0, blocks - 1);
+            };
+            int i0 = block(x0, patch_x), i1 = block(x1, patch_x);
+            int j0 = block(y0, patch_y), j1 = block(y1, patch_y);
+            int bounds_level = 0;
+            while (bounds_level < levels - 1 && (i1 - i0 > 1 || j1 - j0 > 1)) {
+                i0 /= 2, i1 /= 2, j0 /= 2, j1 /= 2;
+                bounds_level++;
+            }
+            for (int j = j0; j <= j1; j++) {
+                for (int i = i0; i <= i1; i++) {
+                    const PatchBound bound = patchBound(patch, size, bounds_level, i, j);
+                    low = std::min(low, bound.low);
+                    high = std::max(high, bound.high);
+                }
+            }
+            store.unpin(packPatchKey(level, patch_x, patch_y));
         }
     }
+    return true;
+}
+
+// Samples from the height source, with gradients converted to world units
+template<typename T>
+void HeightMap<T>::sampleSource(float x, float y, float step, int count, float* out) const {
+    source->sampleRow(x, y, step, count, out);
+    for (int i = 0; i < count; i++) {
+        out[i * patch_channels + 1] /= grid_scale;
+        out[i * patch_channels + 2] /= grid_scale;
+    }
 }
 
 template<typename T>
-T HeightMap<T>::heightAt(float x, float y) {
+float HeightMap<T>::heightAt(float x, float y) {
+    if (source != nullptr) {
+        float sample[patch_channels];
+        sampleSource(x, y, 0, 1, sample);
+        return sample[0];
+    }
     float value = 0;
-    float scale = 30;
-    float detail = 1. / 16;
-    for (int octave = 0; octave < 10; octave++) {
-        value += SimplexNoise1234::noise((x*detail), (y*detail)) * scale;
-        scale /= 2;
-        detail *= 2;
+    for (int octave = 0; octave < octaves; octave++) {
+        value += SimplexNoise1234::noise((x*octave_detail[octave]), (y*octave_detail[octave])) * octave_scale[octave];
     }
 
     //value = (int(x)+int(y)) % 2 == 0 ? int(x) : int (y); // remainder(x+ y, 1) * 20 : -10;
 
-    return value * (grid_scale / 64.f) + 5;
+    return finishHeight(value);
+}
+
+template<typename T>
+float HeightMap<T>::heightAt(float x, float y, float& dh_dx, float& dh_dz) {
+    if (source != nullptr) {
+        float sample[patch_channels];
+        sampleSource(x, y, 0, 1, sample);
+        dh_dx = sample[1];
+        dh_dz = sample[2];
+        return sample[0];
+    }
+    float value = 0;
+    float dx = 0;
+    float dy = 0;
+    for (int octave = 0; octave < octaves; octave++) {
+        float noise_dx, noise_dy;
+        value += SimplexNoise1234::noise((x*octave_detail[octave]), (y*octave_detail[octave]), &noise_dx, &noise_dy) * octave_scale[octave];
+        dx += noise_dx * octave_slope[octave];
+        dy += noise_dy * octave_slope[octave];
+    }
+
+    dh_dx = finishGradient(dx);
+    dh_dz = finishGradient(dy);
+    return finishHeight(value);
 }
 
 // explicit instantiation of available types
-template class HeightMap<uint8_t>;
+template class HeightMap<uint16_t>;
 template class HeightMap<float>;
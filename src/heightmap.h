@@ -4,27 +4,97 @@
 #ifndef TERRAIN_GL_HEIGHTMAP_H
 #define TERRAIN_GL_HEIGHTMAP_H
 
-#include <map>
+#include <cstdint>
+#include <utility>
 #include <vector>
 
+#include "height_source.h"
+#include "patch_format.h"
+#include "patch_store.h"
+#include "patch_workers.h"
+
+// Patches only sum the fBm octaves their sample spacing can represent.
+// The finer octaves are either dropped, which keeps heights unbiased, or
+// have their energy folded into the finest octave kept, which keeps the
+// roughness of coarse levels in line with the finer levels they meet.
+enum class OctaveFill { Drop, PreserveEnergy };
+
 template<typename T>
 class HeightMap {
 public:
-  HeightMap(int grid_size, int grid_scale, int level);
-  T heightAt(float x, float y);
+  // Heights come from source if given (which must outlive the HeightMap),
+  // otherwise from fBm noise.
+  HeightMap(int grid_size, int grid_scale, int level, PatchStore<T>& store,
+            OctaveFill octave_fill = OctaveFill::Drop, PatchWorkers<T>* workers = nullptr,
+            const HeightSource* source = nullptr);
+  float heightAt(float x, float y);
+  float heightAt(float x, float y, float& dh_dx, float& dh_dz);
+  // Interpolated from this level's patch as stored (so after any
+  // quantization), if it's in the store; otherwise returns false.
+  bool storedHeightAt(float x, float y, float& height);
+  // Bounds on the heights of this level's stored patches over
+  // [x0, x1] x [y0, y1], from their bounds pyramids rather than their
+  // samples. Returns false if any patch it covers isn't in the store.
+  bool heightBounds(float x0, float y0, float x1, float y1, float& low, float& high);
 
   std::pair<int, int> getPatchCoords(float x, float y);
-  std::vector<T>& getPatchFor(float fx, float fy);
-  std::vector<GLfloat> grid;
-  std::vector<GLuint> grid_indices;
+  // Blocking, and only safe while no workers share the store
+  T* getPatchFor(float fx, float fy);
+  // Non-blocking: returns the patch at grid (x, y) pinned in the store if
+  // it's ready (the caller unpins it), otherwise queues it on the workers
+  // at the given priority (lower is sooner) and returns nullptr. Without
+  // workers it's generated there and then.
+  T* requestPatch(int x, int y, float priority = 0);
+  // queues the patch if it isn't already in the store, without pinning it
+  void prefetchPatch(int x, int y, float priority);
+  // whether the patch at grid (x, y) is already in the store
+  bool patchStored(int x, int y) { return store.find(level, x, y) != nullptr; }
+  T* buildPatch(int x, int y);
+  void generatePatch(int x, int y, T* target);
+  // Generates every patch with its grid origin in [x0, x1) x [y0, y1) in
+  // one pass over the region, on thread_count threads (0 for every core),
+  // inserting each band of patches into the store as it's finished.
+  // Regions of only a few patches are generated a patch at a time instead.
+  // Patches already stored are skipped. Only safe while no workers share
+  // the store.
+  void generateRegion(int x0, int y0, int x1, int y1, int thread_count = 0);
+  int patchOctaves() const { return patch_octaves; }
+  // identifies everything patches depend on bar their level and position
+  uint64_t generatorHash() const;
+  // bounds every height generated at this level lies within
+  std::pair<float, float> heightRange() const;
+  std::vector<float> grid;
+  std::vector<uint32_t> grid_indices;
 
   int size;
   // size of grid in world units
   int grid_scale;
   int level_factor;
+  int level;
 private:
-  void generatePatch(int x, int y, std::vector<T>& target);
-  std::map<std::pair<int, int>, std::vector<T>> patches;
+  static const int octaves = 10;
+  float octave_scale[octaves];
+  float octave_detail[octaves];
+  float octave_slope[octaves];
+  // amplitudes used by generatePatch() at this level's sample spacing;
+  // zero for the octaves it skips
+  OctaveFill octave_fill;
+  int patch_octaves;
+  float patch_scale[octaves];
+
+  int levelOctaves(int for_level, float amplitude[octaves]) const;
+  void accumulateOctaves(const float* x, const float* y, int count, const float amplitude[octaves],
+                         float* value, float* dx, float* dy) const;
+  struct Scratch;
+  void reuseSamples(int source_level, int grid_x, int grid_y, float* target, Scratch& scratch);
+  void sampleSource(float x, float y, float step, int count, float* out) const;
+
+  float heightScale() const { return grid_scale / 64.f; }
+  float finishHeight(float value) const { return value * heightScale() + 5; }
+  float finishGradient(float slope) const { return slope * heightScale() / grid_scale; }
+  PatchStore<T>& store;
+  PatchWorkers<T>* workers;
+  const HeightSource* source;
 };
 
 #endif //TERRAIN_GL_HEIGHTMAP_H
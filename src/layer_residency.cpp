@@ -0,0 +1,78 @@
+// terrain_gl
+// @codedstructure 2023
+
+#include <algorithm>
+
+#include "layer_residency.h"
+
+LayerResidency::LayerResidency(int layer_count) :
+    layers(layer_count),
+    layer_keys(layer_count, empty_key),
+    drawn(layer_count, -1)
+{
+}
+
+void LayerResidency::beginFrame() {
+    frame++;
+    // evictions too old to count as thrashing needn't be remembered
+    if (frame % thrash_frames == 0) {
+        std::vector<PatchKey> old;
+        evicted_at.forEach([&](PatchKey key, long evicted_frame) {
+            if (frame - evicted_frame > thrash_frames) {
+                old.push_back(key);
+            }
+        });
+        for (PatchKey key : old) {
+            evicted_at.erase(key);
+        }
+    }
+}
+
+int LayerResidency::layersHeld(int level) const {
+    // the level is the key's top 8 bits
+    return int(std::count_if(layer_keys.begin(), layer_keys.end(), [level](PatchKey key) {
+        return key != empty_key && int(key >> 56) == level;
+    }));
+}
+
+int LayerResidency::find(PatchKey key) {
+    auto layer = layers.find(key);
+    if (layer == nullptr) {
+        return -1;
+    }
+    drawn[*layer] = frame;
+    return *layer;
+}
+
+int LayerResidency::allocate(PatchKey key, PatchKey& evicted) {
+    // Empty layers are never drawn, so come first; a scan of a few hundred
+    // layers costs little next to the upload that follows.
+    int oldest = -1;
+    for (int layer = 0; layer < layerCount(); layer++) {
+        if (drawn[layer] < frame && (oldest < 0 || drawn[layer] < drawn[oldest])) {
+            oldest = layer;
+        }
+    }
+    if (oldest < 0) {
+        refused++;
+        return -1;
+    }
+
+    evicted = layer_keys[oldest];
+    if (evicted != empty_key) {
+        layers.erase(evicted);
+        *evicted_at.insert(evicted, frame).first = frame;
+        evictions++;
+    }
+    if (auto evicted_frame = evicted_at.find(key)) {
+        if (frame - *evicted_frame <= thrash_frames) {
+            reuploads++;
+        }
+        evicted_at.erase(key);
+    }
+    layers.insert(key, oldest);
+    layer_keys[oldest] = key;
+    drawn[oldest] = frame;
+    uploads++;
+    return oldest;
+}
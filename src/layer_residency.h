@@ -0,0 +1,49 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_LAYER_RESIDENCY_H
+#define TERRAIN_GL_LAYER_RESIDENCY_H
+
+#include <vector>
+
+#include "patch_index.h"
+
+// Which patch each layer of a texture array holds, and which layer to
+// reuse for a new one. Layers go least recently drawn first, and a layer
+// drawn this frame is never given up within it, so making room can't evict
+// a patch that's in view only for it to be uploaded again next frame.
+class LayerResidency {
+public:
+    explicit LayerResidency(int layer_count);
+
+    void beginFrame();
+    // the layer holding a patch, marked as drawn this frame, or -1
+    int find(PatchKey key);
+    // Gives a patch a layer, marked as drawn this frame: an empty one, else
+    // the least recently drawn. evicted is set to the patch it held, or
+    // empty_key. Returns -1 if every layer has been drawn this frame.
+    int allocate(PatchKey key, PatchKey& evicted);
+
+    int layerCount() const { return int(layer_keys.size()); }
+    PatchKey layerKey(int layer) const { return layer_keys[layer]; }
+    // layers holding patches of the given level
+    int layersHeld(int level) const;
+
+    static constexpr PatchKey empty_key = PatchIndex<int>::empty_key;
+
+    // counters for the periodic stats output
+    long uploads = 0;
+    long evictions = 0;
+    long reuploads = 0;  // of patches evicted within the last thrash_frames
+    long refused = 0;  // allocations with every layer in view
+private:
+    static const long thrash_frames = 60;
+
+    PatchIndex<int> layers;  // (level,x,y) -> layer
+    std::vector<PatchKey> layer_keys;  // layer -> (level,x,y), or empty_key if unused
+    std::vector<long> drawn;  // layer -> frame last drawn
+    PatchIndex<long> evicted_at;  // recently evicted patches -> frame
+    long frame = 0;
+};
+
+#endif //TERRAIN_GL_LAYER_RESIDENCY_H
@@ -13,6 +13,7 @@
 
 #include <cstdlib>
 #include <iostream>
+#include <memory>
 
 #include "player.h"
 #include "shader.h"
@@ -46,7 +47,7 @@ struct Context
     }
 };
 
-int main()
+int main(int argc, char* argv[])
 {
     GLFWwindow *window;
     static Context ctx;
@@ -60,6 +61,25 @@ int main()
           background_location, viewpos_location,
           value_a_location, value_b_location;
 
+    // Heights come from fBm noise (or composedSource()), or an elevation
+    // model if one is given:
+    //   terrain_gl [<model.pgm> | <model.raw> <width> <height>]
+    std::unique_ptr<DemHeightSource> dem_source;
+    if (argc > 1) {
+        DemHeightSource::Layout layout;
+        layout.spacing = dem_spacing;
+        layout.height_scale = dem_height_scale;
+        if (argc > 3) {
+            layout.width = std::strtoul(argv[2], nullptr, 10);
+            layout.height = std::strtoul(argv[3], nullptr, 10);
+        }
+        dem_source = std::make_unique<DemHeightSource>(argv[1], layout);
+        if (!dem_source->isOpen()) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    const HeightSource* height_source = dem_source ? dem_source.get() : composedSource();
+
     glfwSetErrorCallback(error_callback);
 
     if (!glfwInit())
@@ -110,13 +130,31 @@ int main()
     value_b_location = program.uniformLocation("u_value_b");
     program.activate();
 
-    Terrain terrain(0, render_distance, program, nullptr);
-    Terrain terrain2(1, render_distance, program, &terrain);
-    Terrain terrain3(2, render_distance, program, &terrain2);
-    Terrain terrain4(3, render_distance, program, &terrain3);
-    Terrain terrain5(4, render_distance, program, &terrain4);
+    // Patches for all levels live in one store, so each level can reuse
+    // samples already generated for the levels either side of it.
+    PatchStore<PatchSample> patch_store(patchLength<PatchSample>(grid_size), patch_cache_bytes, patch_layout);
+    // Uploads go through a ring of pixel buffers; workers stage the patches
+    // being waited on into it as they finish them. Each frame's uploads are
+    // held to a budget, with coarser levels standing in for what's put off.
+    PatchUploader patch_uploader(patch_store, patchEdge(grid_size), upload_budget_bytes);
+    // one texture array for every level's patches
+    PatchLayers patch_layers(patchEdge(grid_size));
+    // Patches are generated in the background; levels draw their parent's
+    // patch in place of any that aren't ready yet.
+    PatchWorkers<PatchSample> patch_workers;
+    patch_workers.onBuilt([&patch_uploader](HeightMap<PatchSample>& heightMap, int x, int y) {
+        patch_uploader.stage(heightMap.level, x, y);
+    });
+    Terrain terrain(0, render_distance, program, patch_store, patch_workers, patch_uploader, patch_layers, nullptr, height_source);
+    Terrain terrain2(1, render_distance, program, patch_store, patch_workers, patch_uploader, patch_layers, &terrain, height_source);
+    Terrain terrain3(2, render_distance, program, patch_store, patch_workers, patch_uploader, patch_layers, &terrain2, height_source);
+    Terrain terrain4(3, render_distance, program, patch_store, patch_workers, patch_uploader, patch_layers, &terrain3, height_source);
+    Terrain terrain5(4, render_distance, program, patch_store, patch_workers, patch_uploader, patch_layers, &terrain4, height_source);
     // The top level terrain - start rendering from here
-    auto topTerrain = terrain5;
+    auto& topTerrain = terrain5;
+    // Patches persist between runs, so revisited areas need no noise
+    PatchFile<PatchSample> patch_file(patch_cache_path, terrain.heightMap.generatorHash(), patch_store.patchLength());
+    patch_store.attachFile(&patch_file);
 
     Texture stone(STONE_TEX_ID, "images/stone-texture.jpg");
     Texture grass(GRASS_TEX_ID, "images/grass-texture.jpg");
@@ -131,6 +169,11 @@ int main()
             background_colour.b,
             1.0);
 
+    glm::vec3 last_player_pos(player.m_position / float(grid_scale));
+    glm::vec3 player_velocity(0.f);
+    double lastFrameStart = glfwGetTime();
+
+    std::vector<PatchDraw> patch_draws;  // reused each frame
     long frame_counter = 0;
     double worstFrameTime = 0;
     double frameTime = 0;
@@ -145,6 +188,10 @@ int main()
 
         // TODO - pass in dt since last frame, as well as current height
         player.update();
+        // patches not asked for again this frame or last are dropped from the queue
+        patch_workers.beginFrame();
+        patch_uploader.beginFrame();
+        patch_layers.residency.beginFrame();
 
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         glDepthFunc( GL_LEQUAL);
@@ -153,8 +200,6 @@ int main()
         player_pos /= grid_scale;
         glm::vec3 player_dir = glm::normalize(player.m_heading);
 
-        auto height = terrain.heightMap.heightAt(player_pos.x, player_pos.z);
-
         glm::mat4 projection = glm::perspective(
                 glm::radians(75.0f),  // field of view
                 float(ctx.width) / float(ctx.height),  // aspect ratio
@@ -167,8 +212,15 @@ int main()
                         0 // -grid_scale / 2.f
                 )
         );
-        if (player.m_position.y < 10 + height) {
-            player.m_position.y = height + 10;
+        // only sample the ground if the bounds of the patch underfoot don't
+        // already show the player is clear of it
+        float ground_low, ground_high;
+        if (!terrain.heightMap.heightBounds(player_pos.x, player_pos.z, player_pos.x, player_pos.z,
+                                            ground_low, ground_high) || player.m_position.y < 10 + ground_high) {
+            auto height = terrain.heightMap.heightAt(player_pos.x, player_pos.z);
+            if (player.m_position.y < 10 + height) {
+                player.m_position.y = height + 10;
+            }
         }
         glm::mat4 mvp = projection * player.getViewMatrix() * model;
 
@@ -186,9 +238,23 @@ int main()
         glUniform1f(value_b_location, player.controls.value_b);
         glUniform3fv(background_location, 1, glm::value_ptr(background_colour));
 
-        auto frame_triangles = 0;
+        // Select every patch in view, then upload those not yet resident
+        // in one batch, so no draw waits on an upload issued between draws.
+        patch_draws.clear();
+        topTerrain.select_top_level(player_pos, player_dir, patch_draws);
+        Terrain::make_resident(patch_draws);
+
+        // Velocity from the position itself, smoothed over a few frames, so
+        // direct moves with the keys are followed as well as thrust.
+        float dt = frameStart - lastFrameStart;
+        lastFrameStart = frameStart;
+        if (dt > 0) {
+            player_velocity = glm::mix(player_velocity, (player_pos - last_player_pos) / dt, 0.1f);
+        }
+        last_player_pos = player_pos;
+        topTerrain.prefetch_path(player_pos, player_velocity, prefetch_seconds);
 
-        frame_triangles += topTerrain.render_terrain_top_level(player_pos, player_dir);
+        auto frame_triangles = Terrain::submit(patch_draws);
 
         auto thisFrameTime = glfwGetTime() - frameStart;
         frameTime += thisFrameTime;
@@ -201,6 +267,25 @@ int main()
             frame_counter = 0;
             frameTime = 0;
             std::cout << player_pos.x << ","<< player_pos.y << ": (" << player.m_position.x << "," << player.m_position.y <<"," << player.m_position.z <<")\n";
+            std::cout << "patches: " << patch_store.generated_patches << " generated, samples: "
+                      << patch_store.computed_samples << " computed, " << patch_store.reused_samples << " reused, "
+                      << patch_store.loaded_patches << " patches loaded (" << patch_file.patchCount() << " on disk)\n";
+            std::cout << "patch cache: " << patch_store.patchCount() << " patches, " << patch_store.bytesUsed() / (1024 * 1024)
+                      << " MiB, " << patch_store.hits << " hits, " << patch_store.misses << " misses, "
+                      << patch_store.evictions << " evictions, " << patch_workers.pending() << " pending, " << patch_workers.cancelled << " cancelled\n";
+            std::cout << "uploads: " << patch_uploader.worker_staged << " staged by workers, "
+                      << patch_uploader.render_staged << " staged at upload, " << patch_uploader.direct_uploads
+                      << " direct" << (patch_uploader.persistent() ? "" : " (orphaned buffers)") << ", "
+                      << patch_uploader.deferred << " deferred over budget\n";
+            const auto& residency = patch_layers.residency;
+            std::cout << "layers: " << residency.uploads << " uploads, " << residency.evictions << " evictions, "
+                      << residency.reuploads << " re-uploads soon after eviction, " << residency.refused
+                      << " refused with every layer in view\n";
+            std::cout << "layers held by level:";
+            for (int level = 0; level <= topTerrain.heightMap.level; level++) {
+                std::cout << " " << residency.layersHeld(level);
+            }
+            std::cout << " of " << patch_layers.layerCount() << " (" << patch_layers.bytes() / (1024 * 1024) << " MiB)\n";
         }
         glfwSwapBuffers(window);
         glfwPollEvents();
@@ -209,6 +294,8 @@ int main()
         check_error();
     }
 
+    patch_workers.stop();
+    patch_file.close();
     glfwDestroyWindow(window);
     glfwTerminate();
     exit(EXIT_SUCCESS);
@@ -0,0 +1,224 @@
+// terrain_gl
+// @codedstructure 2023
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "patch_file.h"
+
+static const char patch_file_magic[8] = {'T', 'G', 'L', 'P', 'A', 'T', 'C', 'H'};
+static const uint32_t patch_file_version = 1;
+static const size_t page_bytes = 4096;
+
+static size_t page_align(size_t bytes) {
+    return (bytes + page_bytes - 1) / page_bytes * page_bytes;
+}
+
+template<typename T>
+PatchFile<T>::PatchFile(const std::string& path, uint64_t generator, size_t patch_length) :
+    patch_length(patch_length),
+    patch_bytes(patch_length * sizeof(T)),
+    data_offset(page_bytes + page_align(index_slots * sizeof(Slot)))
+{
+    // records can only be written while the index has room for them
+    mapping_bytes = data_offset + capacity() * patch_bytes;
+
+    fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat file_stat;
+    if (fd < 0 || fstat(fd, &file_stat) != 0) {
+        std::cerr << "Patch cache " << path << " unavailable: " << strerror(errno) << "\n";
+        close();
+        return;
+    }
+    void* mapped = mmap(nullptr, mapping_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        std::cerr << "Could not map patch cache " << path << ": " << strerror(errno) << "\n";
+        close();
+        return;
+    }
+    mapping = static_cast<char*>(mapped);
+    header = reinterpret_cast<Header*>(mapping);
+    slots = reinterpret_cast<Slot*>(mapping + page_bytes);
+    file_bytes = file_stat.st_size;
+
+    bool valid = file_bytes >= data_offset &&
+                 std::memcmp(header->magic, patch_file_magic, sizeof(patch_file_magic)) == 0 &&
+                 header->version == patch_file_version &&
+                 header->patch_bytes == patch_bytes &&
+                 header->generator == generator &&
+                 file_bytes >= data_offset + header->count * patch_bytes;
+    if (!valid && !reset(generator)) {
+        std::cerr << "Could not initialise patch cache " << path << ": " << strerror(errno) << "\n";
+        close();
+        return;
+    }
+    writer = std::thread(&PatchFile<T>::write, this);
+}
+
+template<typename T>
+PatchFile<T>::~PatchFile() {
+    close();
+}
+
+template<typename T>
+bool PatchFile<T>::reset(uint64_t generator) {
+    // unmapped pages beyond the end of the file fault, so size it before
+    // touching the header and index
+    if (ftruncate(fd, 0) != 0 || ftruncate(fd, data_offset) != 0) {
+        return false;
+    }
+    file_bytes = data_offset;
+    std::memcpy(header->magic, patch_file_magic, sizeof(patch_file_magic));
+    header->version = patch_file_version;
+    header->patch_bytes = patch_bytes;
+    header->generator = generator;
+    header->count = 0;
+    for (size_t i = 0; i < index_slots; i++) {
+        slots[i] = {PatchIndex<bool>::empty_key, 0};
+    }
+    return true;
+}
+
+template<typename T>
+void PatchFile<T>::close() {
+    {
+        std::lock_guard lock(mutex);
+        closing = true;
+    }
+    wake.notify_all();
+    room.notify_all();
+    if (writer.joinable()) {
+        writer.join();
+    }
+    if (mapping != nullptr) {
+        munmap(mapping, mapping_bytes);
+        mapping = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+template<typename T>
+typename PatchFile<T>::Slot* PatchFile<T>::findSlot(PatchKey key) const {
+    // same probing as PatchIndex, but the table lives in the file
+    for (size_t slot = hashPatchKey(key) % index_slots;; slot = (slot + 1) % index_slots) {
+        if (slots[slot].key == key || slots[slot].key == PatchIndex<bool>::empty_key) {
+            return &slots[slot];
+        }
+    }
+}
+
+template<typename T>
+const T* PatchFile<T>::find(PatchKey key) {
+    const T* patch;
+    {
+        std::lock_guard lock(mutex);
+        if (mapping == nullptr) {
+            return nullptr;
+        }
+        Slot* slot = findSlot(key);
+        if (slot->key != key) {
+            return nullptr;
+        }
+        patch = reinterpret_cast<const T*>(mapping + data_offset + slot->record * patch_bytes);
+    }
+
+    // Fault the pages in here, on the caller's (worker) thread, rather than
+    // when the render thread uploads the patch.
+    // Records aren't page aligned, so a byte is read from each page the
+    // record spans, starting at the page it begins in (still within the
+    // mapping, which is aligned).
+    auto start = reinterpret_cast<uintptr_t>(patch) / page_bytes * page_bytes;
+    auto end = reinterpret_cast<uintptr_t>(patch) + patch_bytes;
+    madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED);
+    volatile char touched = 0;
+    for (uintptr_t page = start; page < end; page += page_bytes) {
+        touched += *reinterpret_cast<const char*>(page);
+    }
+    return patch;
+}
+
+template<typename T>
+bool PatchFile<T>::contains(PatchKey key) const {
+    std::lock_guard lock(mutex);
+    return mapping != nullptr && findSlot(key)->key == key;
+}
+
+template<typename T>
+void PatchFile<T>::append(PatchKey key, const T* patch, bool wait) {
+    {
+        std::unique_lock lock(mutex);
+        if (wait) {
+            room.wait(lock, [this] { return closing || queue.size() < max_queued; });
+        }
+        if (mapping == nullptr || closing || queue.size() >= max_queued ||
+            findSlot(key)->key == key || !queued.insert(key, true).second) {
+            return;
+        }
+        queue.emplace_back(key, std::vector<T>(patch, patch + patch_length));
+    }
+    wake.notify_one();
+}
+
+template<typename T>
+size_t PatchFile<T>::patchCount() const {
+    std::lock_guard lock(mutex);
+    return mapping != nullptr ? header->count : 0;
+}
+
+template<typename T>
+void PatchFile<T>::write() {
+    // only this thread adds records, so count and the file size are ours
+    const size_t grow_records = 64;
+    std::unique_lock lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return closing || !queue.empty(); });
+        if (queue.empty()) {
+            return;  // closing, with everything written
+        }
+        auto [key, patch] = std::move(queue.front());
+        queue.pop_front();
+        room.notify_one();
+        uint64_t record = header->count;
+        if ((record + 1) * 2 > index_slots) {
+            queued.erase(key);
+            continue;  // full
+        }
+        lock.unlock();
+
+        size_t end = data_offset + (record + 1) * patch_bytes;
+        bool written = true;
+        if (end > file_bytes) {
+            size_t grown = std::min(mapping_bytes, data_offset + (record + grow_records) * patch_bytes);
+            written = ftruncate(fd, grown) == 0;
+            if (written) {
+                file_bytes = grown;
+            }
+        }
+        if (written) {
+            std::memcpy(mapping + data_offset + record * patch_bytes, patch.data(), patch_bytes);
+        }
+
+        lock.lock();
+        queued.erase(key);
+        if (written) {
+            // the record is complete before the slot points at it
+            Slot* slot = findSlot(key);
+            slot->record = record;
+            slot->key = key;
+            header->count = record + 1;
+        }
+    }
+}
+
+// explicit instantiation of available types
+template class PatchFile<uint16_t>;
+template class PatchFile<float>;
@@ -0,0 +1,86 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_PATCH_FILE_H
+#define TERRAIN_GL_PATCH_FILE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "patch_index.h"
+
+// Patches persisted between sessions in a single file:
+//
+//   header | fixed-size index of (key, record) slots | patch records...
+//
+// The whole file is mapped, so find() returns a pointer straight into the
+// page cache and cached patches are never copied. The mapping reserves
+// room for every record the index can hold up front, so it never moves as
+// the file grows. New patches are appended by a background thread; the
+// index slot is only published after its record is written.
+//
+// The file is tied to the generator hash it was created with, and starts
+// afresh if opened with a different one.
+template<typename T>
+class PatchFile {
+public:
+    PatchFile(const std::string& path, uint64_t generator, size_t patch_length);
+    ~PatchFile();
+
+    bool isOpen() const { return mapping != nullptr; }
+    // mapped read-only data, paged in before returning, or nullptr
+    const T* find(PatchKey key);
+    bool contains(PatchKey key) const;
+    // Queues a copy of the patch to be written, unless it's already stored.
+    // When the queue is full the patch is dropped, or with wait, the call
+    // blocks until the writer has made room.
+    void append(PatchKey key, const T* patch, bool wait = false);
+    void close();
+
+    size_t patchCount() const;
+    // the most records the file can hold
+    size_t capacity() const { return index_slots / 2; }
+private:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t patch_bytes;
+        uint64_t generator;
+        uint64_t count;  // records written
+    };
+    struct Slot {
+        PatchKey key;
+        uint64_t record;
+    };
+    static const size_t index_slots = size_t(1) << 17;
+    static const size_t max_queued = 256;
+
+    Slot* findSlot(PatchKey key) const;
+    bool reset(uint64_t generator);
+    void write();
+
+    int fd = -1;
+    char* mapping = nullptr;
+    size_t mapping_bytes = 0;
+    size_t patch_length;
+    size_t patch_bytes;
+    size_t data_offset;
+    size_t file_bytes = 0;
+    Header* header = nullptr;
+    Slot* slots = nullptr;
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable room;
+    std::deque<std::pair<PatchKey, std::vector<T>>> queue;
+    PatchIndex<bool> queued;
+    bool closing = false;
+    std::thread writer;
+};
+
+#endif //TERRAIN_GL_PATCH_FILE_H
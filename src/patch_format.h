@@ -0,0 +1,257 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_PATCH_FORMAT_H
+#define TERRAIN_GL_PATCH_FORMAT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+// Each patch sample is the height followed by its gradient (dh/dx, dh/dz in
+// world units), interleaved so the vertex shader gets all three in one fetch.
+const int patch_channels = 3;
+
+// samples along each edge of a patch: the grid plus a 1/8 apron either side
+inline int patchEdge(int grid_size) { return grid_size + grid_size / 4 + 1; }
+
+// How samples are ordered within a patch. Row-major is what the GPU takes.
+// 8x8 tiles keep a neighbourhood of samples (bilinear or Sobel taps) within
+// a few cache lines, where row-major puts each row of taps a patch row
+// apart. Tiles along the right and bottom edges are narrower rather than
+// padded, so tiled patches are no larger.
+enum class PatchLayout { RowMajor, Tiled };
+const int patch_tile = 8;
+
+// position of sample (i, j) (column, row) within a patch, in samples
+inline size_t patchSampleIndex(PatchLayout layout, int edge, int i, int j) {
+    if (layout == PatchLayout::RowMajor) {
+        return size_t(j) * edge + i;
+    }
+    const int tile_left = i / patch_tile * patch_tile;
+    const int tile_top = j / patch_tile * patch_tile;
+    const int tile_width = std::min(patch_tile, edge - tile_left);
+    const int tile_height = std::min(patch_tile, edge - tile_top);
+    return size_t(tile_top) * edge + size_t(tile_left) * tile_height + (j - tile_top) * tile_width + (i - tile_left);
+}
+
+// Copies a patch's samples into row-major order, e.g. for upload
+template<typename T>
+void patchToRowMajor(const T* patch, int edge, PatchLayout layout, T* row_major) {
+    const size_t row_values = size_t(edge) * patch_channels;
+    if (layout == PatchLayout::RowMajor) {
+        std::copy(patch, patch + row_values * edge, row_major);
+        return;
+    }
+    // each row of each tile is a contiguous run
+    for (int j = 0; j < edge; j++) {
+        for (int i = 0; i < edge; i += patch_tile) {
+            const T* run = &patch[patchSampleIndex(layout, edge, i, j) * patch_channels];
+            std::copy(run, run + std::min(patch_tile, edge - i) * patch_channels,
+                      &row_major[j * row_values + i * patch_channels]);
+        }
+    }
+}
+
+// Maps stored sample values back to floats per channel:
+//   value = offset + stored * range
+// where stored is normalised to [0, 1], as the GPU samples 16-bit textures.
+struct PatchQuantization {
+    float offset[patch_channels];
+    float range[patch_channels];
+};
+
+// Patches are stored either as floats, or as uint16_t quantized per channel
+// between the patch's own minimum and maximum. Quantized patches take half
+// the memory, texture memory and upload bandwidth, and carry their
+// PatchQuantization in a trailer after the samples.
+template<typename T>
+constexpr size_t patchTrailer() {
+    static_assert(std::is_same_v<T, float> || std::is_same_v<T, uint16_t>, "patches are float or uint16_t");
+    return std::is_same_v<T, uint16_t> ? sizeof(PatchQuantization) / sizeof(T) : 0;
+}
+
+// Each patch also carries a pyramid of height bounds over its grid (not
+// its apron), for culling and for rejecting ray and collision queries
+// without reading samples. The finest level splits the grid into blocks of
+// patch_bounds_block x patch_bounds_block samples, and each level after it
+// has half as many blocks along each axis, down to one block for the whole
+// grid. A block's bounds include the samples along its edges, so hold
+// every height interpolated within it. The bounds are floats whatever the
+// patch type, stored finest level first, each level row-major.
+struct PatchBound {
+    float low, high;
+};
+const int patch_bounds_block = 8;
+
+// grid_size must be a power of two, at least patch_bounds_block
+inline int patchBoundsBlocks(int grid_size) { return grid_size / patch_bounds_block; }
+inline int patchBoundsLevels(int grid_size) {
+    int levels = 1;
+    for (int blocks = patchBoundsBlocks(grid_size); blocks > 1; blocks /= 2) {
+        levels++;
+    }
+    return levels;
+}
+inline size_t patchBoundsCount(int grid_size) {
+    size_t count = 0;
+    for (int blocks = patchBoundsBlocks(grid_size); blocks >= 1; blocks /= 2) {
+        count += size_t(blocks) * blocks;
+    }
+    return count;
+}
+inline int patchGridSize(int edge) { return (edge - 1) / 5 * 4; }
+
+// values (samples and trailer) before a patch's bounds
+template<typename T>
+size_t patchBoundsOffset(int grid_size) {
+    return size_t(patchEdge(grid_size)) * patchEdge(grid_size) * patch_channels + patchTrailer<T>();
+}
+
+// values (samples, trailer and bounds) in each patch
+template<typename T>
+size_t patchLength(int grid_size) {
+    return patchBoundsOffset<T>(grid_size) + patchBoundsCount(grid_size) * sizeof(PatchBound) / sizeof(T);
+}
+
+// Bounds of block (i, j) of the given pyramid level, where level 0 is the
+// finest. Copied out, as the bounds in 16-bit patches needn't be aligned.
+template<typename T>
+PatchBound patchBound(const T* patch, int grid_size, int level, int i, int j) {
+    size_t index = 0;
+    int blocks = patchBoundsBlocks(grid_size);
+    for (; level > 0; level--) {
+        index += size_t(blocks) * blocks;
+        blocks /= 2;
+    }
+    index += size_t(j) * blocks + i;
+    PatchBound bound;
+    std::memcpy(&bound, reinterpret_cast<const char*>(patch + patchBoundsOffset<T>(grid_size)) + index * sizeof(bound),
+                sizeof(bound));
+    return bound;
+}
+
+// Builds the bounds pyramid of a row-major edge x edge patch of float
+// values, each bound widened by margin.
+inline void patchBoundsPyramid(const float* values, int edge, float margin, PatchBound* bounds) {
+    const int grid_size = patchGridSize(edge);
+    const int apron = grid_size / 8;
+    int blocks = patchBoundsBlocks(grid_size);
+    for (int j = 0; j < blocks; j++) {
+        for (int i = 0; i < blocks; i++) {
+            const float* corner = &values[(size_t(apron + j * patch_bounds_block) * edge +
+                                           apron + i * patch_bounds_block) * patch_channels];
+            PatchBound bound{corner[0], corner[0]};
+            for (int v = 0; v <= patch_bounds_block; v++) {
+                const float* row = corner + size_t(v) * edge * patch_channels;
+                for (int u = 0; u <= patch_bounds_block; u++) {
+                    bound.low = std::min(bound.low, row[u * patch_channels]);
+                    bound.high = std::max(bound.high, row[u * patch_channels]);
+                }
+            }
+            bounds[j * blocks + i] = {bound.low - margin, bound.high + margin};
+        }
+    }
+    // each coarser block bounds the four below it
+    for (; blocks > 1; blocks /= 2) {
+        const PatchBound* finer = bounds;
+        bounds += blocks * blocks;
+        const int coarser = blocks / 2;
+        for (int j = 0; j < coarser; j++) {
+            for (int i = 0; i < coarser; i++) {
+                const PatchBound* quad[] = {&finer[2 * j * blocks + 2 * i], &finer[2 * j * blocks + 2 * i + 1],
+                                            &finer[(2 * j + 1) * blocks + 2 * i], &finer[(2 * j + 1) * blocks + 2 * i + 1]};
+                PatchBound bound = *quad[0];
+                for (const PatchBound* child : quad) {
+                    bound.low = std::min(bound.low, child->low);
+                    bound.high = std::max(bound.high, child->high);
+                }
+                bounds[j * coarser + i] = bound;
+            }
+        }
+    }
+}
+
+// Stores a row-major edge x edge patch of interleaved float values as a
+// patch with the given layout. values may be patch itself for row-major
+// float patches.
+template<typename T>
+void encodePatch(const float* values, int edge, PatchLayout layout, T* patch) {
+    const size_t count = size_t(edge) * edge * patch_channels;
+    float offset[patch_channels] = {};
+    float scale[patch_channels];
+    float bounds_margin = 0;
+    if constexpr (std::is_same_v<T, uint16_t>) {
+        PatchQuantization quantization;
+        for (int channel = 0; channel < patch_channels; channel++) {
+            float low = values[channel], high = values[channel];
+            for (size_t i = channel; i < count; i += patch_channels) {
+                low = std::min(low, values[i]);
+                high = std::max(high, values[i]);
+            }
+            quantization.offset[channel] = offset[channel] = low;
+            quantization.range[channel] = high - low;
+            scale[channel] = high > low ? 65535 / (high - low) : 0;
+        }
+        std::memcpy(patch + count, &quantization, sizeof(quantization));
+        // a quantization step covers the rounding of the stored heights
+        bounds_margin = quantization.range[0] / 65535;
+    }
+    const int grid_size = patchGridSize(edge);
+    static thread_local std::vector<PatchBound> bounds;
+    bounds.resize(patchBoundsCount(grid_size));
+    patchBoundsPyramid(values, edge, bounds_margin, bounds.data());
+    std::memcpy(patch + patchBoundsOffset<T>(grid_size), bounds.data(), bounds.size() * sizeof(PatchBound));
+
+    // runs of whole samples, so each starts at channel 0
+    auto encode = [&](const float* from, size_t length, T* to) {
+        if constexpr (std::is_same_v<T, float>) {
+            if (from != to) {
+                std::copy(from, from + length, to);
+            }
+        } else {
+            for (size_t i = 0; i < length; i++) {
+                const int channel = i % patch_channels;
+                to[i] = T(std::lround((from[i] - offset[channel]) * scale[channel]));
+            }
+        }
+    };
+    if (layout == PatchLayout::RowMajor) {
+        encode(values, count, patch);
+        return;
+    }
+    for (int j = 0; j < edge; j++) {
+        for (int i = 0; i < edge; i += patch_tile) {
+            encode(&values[(size_t(j) * edge + i) * patch_channels], std::min(patch_tile, edge - i) * patch_channels,
+                   &patch[patchSampleIndex(layout, edge, i, j) * patch_channels]);
+        }
+    }
+}
+
+template<typename T>
+PatchQuantization patchQuantization(const T* patch, size_t count) {
+    PatchQuantization quantization;
+    if constexpr (std::is_same_v<T, float>) {
+        std::fill_n(quantization.offset, patch_channels, 0.f);
+        std::fill_n(quantization.range, patch_channels, 1.f);
+    } else {
+        std::memcpy(&quantization, patch + count, sizeof(quantization));
+    }
+    return quantization;
+}
+
+// one channel of one stored sample, as a float
+template<typename T>
+float decodeValue(const T* sample, const PatchQuantization& quantization, int channel) {
+    if constexpr (std::is_same_v<T, float>) {
+        return sample[channel];
+    } else {
+        return quantization.offset[channel] + sample[channel] * (quantization.range[channel] / 65535);
+    }
+}
+
+#endif //TERRAIN_GL_PATCH_FORMAT_H
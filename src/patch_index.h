@@ -0,0 +1,137 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_PATCH_INDEX_H
+#define TERRAIN_GL_PATCH_INDEX_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Patch coordinates packed into one 64-bit key: 8 bits of level, then 28
+// bits each of (signed) grid x and y, which covers +/-134M grid units.
+using PatchKey = uint64_t;
+
+// grid coordinates in [-patch_coord_limit, patch_coord_limit) have distinct keys
+const int patch_coord_bits = 28;
+const int patch_coord_limit = 1 << (patch_coord_bits - 1);
+
+inline PatchKey packPatchKey(int level, int x, int y) {
+    const uint64_t mask = (uint64_t(1) << patch_coord_bits) - 1;
+    return (uint64_t(level) & 0xff) << 56 | (uint64_t(uint32_t(x)) & mask) << 28 | (uint64_t(uint32_t(y)) & mask);
+}
+
+// splitmix64 finaliser: neighbouring patches hash to unrelated values
+inline uint64_t hashPatchKey(PatchKey key) {
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ull;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebull;
+    key ^= key >> 31;
+    return key;
+}
+
+// Open-addressing hash map from PatchKey to V, for the lookups made for every
+// patch every frame. Entries live in one flat array probed linearly, so a
+// lookup is normally a hash and a single cache line rather than a walk down
+// a tree of separately allocated nodes.
+template<typename V>
+class PatchIndex {
+public:
+    // never a valid packed key, as level 255 is never used
+    static constexpr PatchKey empty_key = ~PatchKey(0);
+
+    explicit PatchIndex(size_t expected = 16) {
+        size_t capacity = 16;
+        while (capacity < expected * 2) {
+            capacity *= 2;
+        }
+        slots.assign(capacity, {empty_key, V()});
+    }
+
+    V* find(PatchKey key) {
+        for (size_t slot = home(key);; slot = next(slot)) {
+            if (slots[slot].first == key) {
+                return &slots[slot].second;
+            }
+            if (slots[slot].first == empty_key) {
+                return nullptr;
+            }
+        }
+    }
+
+    // Returns the value stored for key, and whether it was newly inserted
+    std::pair<V*, bool> insert(PatchKey key, const V& value) {
+        if ((count + 1) * 2 > slots.size()) {
+            grow();
+        }
+        size_t slot = home(key);
+        for (; slots[slot].first != empty_key; slot = next(slot)) {
+            if (slots[slot].first == key) {
+                return {&slots[slot].second, false};
+            }
+        }
+        slots[slot] = {key, value};
+        count++;
+        return {&slots[slot].second, true};
+    }
+
+    bool erase(PatchKey key) {
+        if (key == empty_key) {
+            return false;
+        }
+        size_t slot = home(key);
+        for (; slots[slot].first != key; slot = next(slot)) {
+            if (slots[slot].first == empty_key) {
+                return false;
+            }
+        }
+        // Shift later entries of the probe run back over the hole, so
+        // lookups never need tombstones.
+        for (size_t scan = next(slot);; scan = next(scan)) {
+            if (slots[scan].first == empty_key) {
+                break;
+            }
+            size_t scan_home = home(slots[scan].first);
+            if (((scan - scan_home) & mask()) >= ((scan - slot) & mask())) {
+                slots[slot] = slots[scan];
+                slot = scan;
+            }
+        }
+        slots[slot] = {empty_key, V()};
+        count--;
+        return true;
+    }
+
+    size_t size() const { return count; }
+
+    template<typename F>
+    void forEach(F&& f) {
+        for (auto& [key, value] : slots) {
+            if (key != empty_key) {
+                f(key, value);
+            }
+        }
+    }
+private:
+    size_t mask() const { return slots.size() - 1; }
+    size_t next(size_t slot) const { return (slot + 1) & mask(); }
+    size_t home(PatchKey key) const { return hashPatchKey(key) & mask(); }
+
+    void grow() {
+        std::vector<std::pair<PatchKey, V>> old(slots.size() * 2, {empty_key, V()});
+        old.swap(slots);
+        count = 0;
+        for (auto& [key, value] : old) {
+            if (key != empty_key) {
+                insert(key, value);
+            }
+        }
+    }
+
+    std::vector<std::pair<PatchKey, V>> slots;
+    size_t count = 0;
+};
+
+#endif //TERRAIN_GL_PATCH_INDEX_H
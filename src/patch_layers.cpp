@@ -0,0 +1,57 @@
+// terrain_gl
+// @codedstructure 2023
+
+#include <algorithm>
+
+#include "patch_layers.h"
+#include "patch_upload.h"
+
+int PatchLayers::supportedLayers(int wanted) {
+    GLint max_layers = 256;  // the least OpenGL implementations must support
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &max_layers);
+    return std::min(wanted, int(max_layers));
+}
+
+PatchLayers::PatchLayers(int edge, int layer_count) :
+    residency(supportedLayers(layer_count)),
+    quantization(residency.layerCount()),
+    edge(edge)
+{
+    glGenTextures(1, &texId);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texId);
+    glTexParameteri ( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
+    glTexParameteri ( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
+    // Constant border to exacerbate edge effects - we want to deal with them internally and
+    // never hit the edge here.
+    // TODO: consider REPEAT vs CONSTANT_BORDER
+    glTexParameteri ( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CONSTANT_BORDER );
+    glTexParameteri ( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CONSTANT_BORDER );
+    // The texture is calculated at a larger size than the rendered patch,
+    // and the texture coordinates are shifted towards the centre of the
+    // texture and reduce edge-effects. Needs to tie up with heightmap
+    // generation and the vertex shader...
+    glTexImage3D(
+            GL_TEXTURE_2D_ARRAY, // target
+            0, // mipmap level
+            PatchTexture<PatchSample>::internal_format, // height and its gradient
+            edge, // width
+            edge, // height
+            layerCount(), // depth (number of layers)
+            0, // border
+            GL_RGB, // format
+            PatchTexture<PatchSample>::type,
+            nullptr
+    );
+}
+
+PatchLayers::~PatchLayers() {
+    glDeleteTextures(1, &texId);
+}
+
+void PatchLayers::bind() const {
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texId);
+}
+
+size_t PatchLayers::bytes() const {
+    return size_t(edge) * edge * patch_channels * sizeof(PatchSample) * layerCount();
+}
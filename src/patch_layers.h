@@ -0,0 +1,40 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_PATCH_LAYERS_H
+#define TERRAIN_GL_PATCH_LAYERS_H
+
+#include <vector>
+#include <GL/glew.h>
+
+#include "layer_residency.h"
+#include "terrain_config.h"
+
+// The one texture array every level's patches are uploaded to. Sharing it
+// lets the layers go to whichever levels need them: close to the ground
+// most are in use by the finer levels, at altitude by the coarser ones,
+// with no layers set aside for levels that draw little.
+class PatchLayers {
+public:
+    // layer_count is capped at what the implementation supports
+    explicit PatchLayers(int edge, int layer_count = default_layers);
+    PatchLayers(const PatchLayers&) = delete;
+    PatchLayers& operator=(const PatchLayers&) = delete;
+    ~PatchLayers();
+
+    void bind() const;
+    int layerCount() const { return residency.layerCount(); }
+    size_t bytes() const;
+
+    LayerResidency residency;  // which patch each layer holds
+    std::vector<PatchQuantization> quantization;  // how to read back each layer's values
+private:
+    // enough for every level in view at once, at render_distance 3
+    static const int default_layers = 512;
+    static int supportedLayers(int wanted);
+
+    int edge;
+    GLuint texId = 0;
+};
+
+#endif //TERRAIN_GL_PATCH_LAYERS_H
@@ -0,0 +1,34 @@
+// terrain_gl
+// @codedstructure 2023
+
+#include "patch_pool.h"
+
+template<typename T>
+PatchPool<T>::PatchPool(size_t patch_length) :
+    patch_length(patch_length)
+{
+}
+
+template<typename T>
+typename PatchPool<T>::Handle PatchPool<T>::allocate() {
+    if (free_handles.empty()) {
+        // new slab; hand out its buffers lowest first
+        Handle first = capacity();
+        slabs.emplace_back(new T[slab_patches * patch_length]);
+        for (Handle handle = first + slab_patches; handle > first; handle--) {
+            free_handles.push_back(handle - 1);
+        }
+    }
+    Handle handle = free_handles.back();
+    free_handles.pop_back();
+    return handle;
+}
+
+template<typename T>
+void PatchPool<T>::release(Handle handle) {
+    free_handles.push_back(handle);
+}
+
+// explicit instantiation of available types
+template class PatchPool<uint16_t>;
+template class PatchPool<float>;
@@ -0,0 +1,38 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_PATCH_POOL_H
+#define TERRAIN_GL_PATCH_POOL_H
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Every patch has the same number of samples, so patch buffers are carved
+// out of slabs of slab_patches at a time rather than each being its own heap
+// allocation. Released buffers go on a free list for the next patch.
+// Handles stay valid (and buffers stay put) until released.
+template<typename T>
+class PatchPool {
+public:
+    using Handle = uint32_t;
+
+    explicit PatchPool(size_t patch_length);
+
+    Handle allocate();
+    void release(Handle handle);
+    T* data(Handle handle) const {
+        return slabs[handle / slab_patches].get() + (handle % slab_patches) * patch_length;
+    }
+
+    size_t patchLength() const { return patch_length; }
+    size_t capacity() const { return slabs.size() * slab_patches; }
+    size_t inUse() const { return capacity() - free_handles.size(); }
+private:
+    static const int slab_patches = 64;
+    size_t patch_length;
+    std::vector<std::unique_ptr<T[]>> slabs;
+    std::vector<Handle> free_handles;
+};
+
+#endif //TERRAIN_GL_PATCH_POOL_H
@@ -0,0 +1,221 @@
+// terrain_gl
+// @codedstructure 2023
+
+#include <cstdint>
+
+#include "patch_store.h"
+
+template<typename T>
+PatchStore<T>::PatchStore(size_t patch_length, size_t budget_bytes, PatchLayout layout) :
+    pool(patch_length),
+    patch_bytes(pool.patchLength() * sizeof(T)),
+    budget_bytes(budget_bytes),
+    sample_layout(layout)
+{
+}
+
+template<typename T>
+T* PatchStore<T>::find(int level, int x, int y) {
+    std::lock_guard lock(mutex);
+    auto found_patch = patches.find(packPatchKey(level, x, y));
+    if (found_patch == nullptr) {
+        return nullptr;
+    }
+    touch(*found_patch);
+    return patchData(*found_patch);
+}
+
+template<typename T>
+T* PatchStore<T>::acquire(int level, int x, int y) {
+    std::lock_guard lock(mutex);
+    auto found_patch = patches.find(packPatchKey(level, x, y));
+    if (found_patch == nullptr) {
+        return nullptr;
+    }
+    if (entry(*found_patch).pins++ == 0) {
+        unlink(*found_patch);
+    }
+    return patchData(*found_patch);
+}
+
+template<typename T>
+T* PatchStore<T>::data(Handle handle) const {
+    std::lock_guard lock(mutex);
+    return pool.data(handle);
+}
+
+template<typename T>
+size_t PatchStore<T>::patchCount() const {
+    std::lock_guard lock(mutex);
+    return patches.size();
+}
+
+template<typename T>
+typename PatchStore<T>::Handle PatchStore<T>::allocate() {
+    std::lock_guard lock(mutex);
+    // make room first, so the pool can hand the evicted buffer straight back
+    while ((patches.size() + unpublished + 1) * patch_bytes > budget_bytes && evict()) {
+    }
+    auto handle = pool.allocate();
+    unpublished++;
+    if (entries.size() < pool.capacity()) {
+        entries.resize(pool.capacity());
+    }
+    return handle;
+}
+
+template<typename T>
+T* PatchStore<T>::insert(int level, int x, int y, Handle handle) {
+    std::lock_guard lock(mutex);
+    return insertLocked(packPatchKey(level, x, y), handle);
+}
+
+template<typename T>
+void PatchStore<T>::insertAll(const std::vector<std::pair<PatchKey, Handle>>& generated) {
+    std::lock_guard lock(mutex);
+    for (auto [key, handle] : generated) {
+        insertLocked(key, handle);
+    }
+}
+
+template<typename T>
+T* PatchStore<T>::insertLocked(PatchKey key, Handle handle) {
+    generated_patches++;
+    unpublished--;
+    entry(handle).mapped = nullptr;
+    auto [patch, inserted] = publish(key, handle);
+    if (inserted && file != nullptr) {
+        file->append(key, patch);
+    }
+    return patch;
+}
+
+template<typename T>
+T* PatchStore<T>::load(int level, int x, int y) {
+    if (file == nullptr) {
+        return nullptr;
+    }
+    auto key = packPatchKey(level, x, y);
+    // paging the patch in can take a while, so outside the lock
+    auto mapped = const_cast<T*>(file->find(key));
+    if (mapped == nullptr) {
+        return nullptr;
+    }
+
+    std::lock_guard lock(mutex);
+    while ((patches.size() + unpublished + 1) * patch_bytes > budget_bytes && evict()) {
+    }
+    Handle handle;
+    if (!free_mapped.empty()) {
+        handle = free_mapped.back();
+        free_mapped.pop_back();
+    } else {
+        handle = Handle(mapped_entries.size()) | mapped_handle;
+        mapped_entries.emplace_back();
+    }
+    entry(handle).mapped = mapped;
+    loaded_patches++;
+    return publish(key, handle).first;
+}
+
+template<typename T>
+void PatchStore<T>::attachFile(PatchFile<T>* patch_file) {
+    std::lock_guard lock(mutex);
+    file = patch_file != nullptr && patch_file->isOpen() ? patch_file : nullptr;
+}
+
+// Adds the patch to the index, unless one is already there for key. Then
+// the existing patch is kept, as it may be pinned and being read, and the
+// new buffer is released instead. Returns the patch in the index, and
+// whether it's the new one.
+template<typename T>
+std::pair<T*, bool> PatchStore<T>::publish(PatchKey key, Handle handle) {
+    auto [existing, inserted] = patches.insert(key, handle);
+    if (!inserted) {
+        release(handle);
+        touch(*existing);
+        return {patchData(*existing), false};
+    }
+    auto& published = entry(handle);
+    published.key = key;
+    published.pins = 0;
+    link(handle);
+    return {patchData(handle), true};
+}
+
+template<typename T>
+void PatchStore<T>::release(Handle handle) {
+    if (handle & mapped_handle) {
+        free_mapped.push_back(handle);
+    } else {
+        pool.release(handle);
+    }
+}
+
+template<typename T>
+bool PatchStore<T>::pin(PatchKey key) {
+    std::lock_guard lock(mutex);
+    auto found_patch = patches.find(key);
+    if (found_patch == nullptr) {
+        return false;
+    }
+    if (entry(*found_patch).pins++ == 0) {
+        unlink(*found_patch);
+    }
+    return true;
+}
+
+template<typename T>
+void PatchStore<T>::unpin(PatchKey key) {
+    std::lock_guard lock(mutex);
+    auto found_patch = patches.find(key);
+    if (found_patch != nullptr && entry(*found_patch).pins > 0 &&
+        --entry(*found_patch).pins == 0) {
+        link(*found_patch);
+    }
+}
+
+template<typename T>
+void PatchStore<T>::link(Handle handle) {
+    entry(handle).newer = no_handle;
+    entry(handle).older = newest;
+    if (newest != no_handle) {
+        entry(newest).newer = handle;
+    } else {
+        oldest = handle;
+    }
+    newest = handle;
+}
+
+template<typename T>
+void PatchStore<T>::unlink(Handle handle) {
+    auto& unlinked = entry(handle);
+    (unlinked.newer != no_handle ? entry(unlinked.newer).older : newest) = unlinked.older;
+    (unlinked.older != no_handle ? entry(unlinked.older).newer : oldest) = unlinked.newer;
+}
+
+template<typename T>
+void PatchStore<T>::touch(Handle handle) {
+    if (entry(handle).pins == 0) {
+        unlink(handle);
+        link(handle);
+    }
+}
+
+template<typename T>
+bool PatchStore<T>::evict() {
+    // pinned patches are unlinked, so the oldest linked one can always go
+    if (oldest == no_handle) {
+        return false;
+    }
+    auto handle = oldest;
+    unlink(handle);
+    patches.erase(entry(handle).key);
+    release(handle);
+    evictions++;
+    return true;
+}
+
+// explicit instantiation of available types
+template class PatchStore<uint16_t>;
+template class PatchStore<float>;
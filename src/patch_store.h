@@ -0,0 +1,118 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_PATCH_STORE_H
+#define TERRAIN_GL_PATCH_STORE_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "patch_file.h"
+#include "patch_format.h"
+#include "patch_index.h"
+#include "patch_pool.h"
+
+// Generated patches for every terrain level, shared between the levels'
+// HeightMaps so each can build on samples the others have already computed.
+// Patches are generated straight into a buffer from allocate(), then
+// published with insert(). Inserting a patch that's already stored keeps
+// the stored one and releases the new buffer.
+//
+// The store keeps within budget_bytes by evicting the least recently used
+// patch when allocating, counting buffers allocated but not yet inserted.
+// Pinned patches (those resident on the GPU) are never evicted, so the
+// budget can be exceeded if everything is pinned.
+//
+// The store is shared with the generation workers, so every call takes its
+// lock. A pointer from find() or insert() can be evicted by the next
+// allocate() on any thread; use acquire() to read a patch while workers are
+// running, and unpin() it when finished.
+//
+// Every patch in the store has the same sample layout; see PatchLayout.
+//
+// With a PatchFile attached, inserted patches are also written to it, and
+// load() brings patches back from it. Loaded patches stay in the file's
+// mapping rather than being copied into the pool; like every published
+// patch, they must not be written to.
+template<typename T>
+class PatchStore {
+public:
+    using Handle = typename PatchPool<T>::Handle;
+
+    explicit PatchStore(size_t patch_length, size_t budget_bytes = SIZE_MAX,
+                        PatchLayout layout = PatchLayout::RowMajor);
+
+    T* find(int level, int x, int y);
+    T* acquire(int level, int x, int y);
+    Handle allocate();
+    T* data(Handle handle) const;
+    T* insert(int level, int x, int y, Handle handle);
+    // publishes a whole batch of generated patches under one lock
+    void insertAll(const std::vector<std::pair<PatchKey, Handle>>& generated);
+    T* load(int level, int x, int y);
+    void attachFile(PatchFile<T>* file);
+
+    // pins nest; returns false if the patch isn't in the store
+    bool pin(PatchKey key);
+    void unpin(PatchKey key);
+
+    size_t patchLength() const { return pool.patchLength(); }
+    PatchLayout layout() const { return sample_layout; }
+    size_t patchCount() const;
+    size_t bytesUsed() const { return patchCount() * patch_bytes; }
+
+    // counters for the periodic stats output
+    std::atomic<long> generated_patches{0};
+    std::atomic<long> computed_samples{0};
+    std::atomic<long> reused_samples{0};
+    std::atomic<long> hits{0};
+    std::atomic<long> misses{0};
+    std::atomic<long> evictions{0};
+    std::atomic<long> loaded_patches{0};
+private:
+    static constexpr Handle no_handle = ~Handle(0);
+    // handles with this bit set are patches mapped from the file
+    static constexpr Handle mapped_handle = Handle(1) << 31;
+
+    // per handle; unpinned patches are linked most recent first
+    struct Entry {
+        PatchKey key;
+        Handle newer, older;
+        int pins;
+        T* mapped;
+    };
+
+    Entry& entry(Handle handle) {
+        return handle & mapped_handle ? mapped_entries[handle & ~mapped_handle] : entries[handle];
+    }
+    T* patchData(Handle handle) const {
+        return handle & mapped_handle ? mapped_entries[handle & ~mapped_handle].mapped : pool.data(handle);
+    }
+    T* insertLocked(PatchKey key, Handle handle);
+    std::pair<T*, bool> publish(PatchKey key, Handle handle);
+    void release(Handle handle);
+    void link(Handle handle);
+    void unlink(Handle handle);
+    void touch(Handle handle);
+    bool evict();
+
+    mutable std::mutex mutex;
+
+    PatchPool<T> pool;
+    PatchIndex<Handle> patches;
+    std::vector<Entry> entries;
+    std::vector<Entry> mapped_entries;
+    std::vector<Handle> free_mapped;
+    PatchFile<T>* file = nullptr;
+    Handle newest = no_handle;
+    Handle oldest = no_handle;
+    size_t unpublished = 0;  // allocated, not yet inserted
+    size_t patch_bytes;
+    size_t budget_bytes;
+    PatchLayout sample_layout;
+};
+
+#endif //TERRAIN_GL_PATCH_STORE_H
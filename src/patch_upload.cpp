@@ -0,0 +1,222 @@
+// terrain_gl
+// @codedstructure 2023
+
+#include <algorithm>
+#include <cstdint>
+
+#include "patch_upload.h"
+
+// buffer offsets handed to glTexSubImage3D are kept to this alignment
+static const size_t slot_alignment = 256;
+
+PatchUploader::PatchUploader(PatchStore<PatchSample>& patch_store, int edge, size_t frame_budget_bytes,
+                             int slot_count) :
+    patch_store(patch_store),
+    edge(edge),
+    slot_values(size_t(edge) * edge * patch_channels),
+    frame_budget_bytes(frame_budget_bytes),
+    slot_stride((slot_values * sizeof(PatchSample) + slot_alignment - 1) / slot_alignment * slot_alignment /
+                sizeof(PatchSample)),
+    slots(slot_count)
+{
+    const auto slot_bytes = GLsizeiptr(slot_stride * sizeof(PatchSample));
+    if (GLEW_ARB_buffer_storage) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &ring_buffer);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring_buffer);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, slot_bytes * slot_count, nullptr, flags);
+        mapping = static_cast<PatchSample*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slot_bytes * slot_count, flags));
+        if (mapping == nullptr) {
+            glDeleteBuffers(1, &ring_buffer);
+            ring_buffer = 0;
+        }
+    }
+    if (mapping == nullptr) {
+        for (auto& slot : slots) {
+            glGenBuffers(1, &slot.buffer);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, slot.buffer);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, slot_bytes, nullptr, GL_STREAM_DRAW);
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+PatchUploader::~PatchUploader() {
+    for (auto& slot : slots) {
+        if (slot.fence != nullptr) {
+            glDeleteSync(slot.fence);
+        }
+        if (slot.buffer != 0) {
+            glDeleteBuffers(1, &slot.buffer);
+        }
+    }
+    if (ring_buffer != 0) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring_buffer);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &ring_buffer);
+    }
+}
+
+void PatchUploader::beginFrame() {
+    std::lock_guard lock(mutex);
+    frame++;
+    frame_bytes = 0;
+    for (int i = 0; i < int(slots.size()); i++) {
+        auto& slot = slots[i];
+        if (slot.state == SlotState::InFlight && slot.fence != nullptr) {
+            // polled, never waited on
+            const GLenum status = glClientWaitSync(slot.fence, 0, 0);
+            if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+                glDeleteSync(slot.fence);
+                slot.fence = nullptr;
+                slot.state = SlotState::Free;
+            }
+        } else if (slot.state == SlotState::Staged && frame - slot.frame > staged_frames) {
+            // staged for a patch that was never drawn after all
+            staged.erase(slot.key);
+            slot.state = SlotState::Free;
+        }
+    }
+    std::vector<PatchKey> stale;
+    wanted.forEach([&](PatchKey key, long wanted_frame) {
+        if (frame - wanted_frame > keep_frames) {
+            stale.push_back(key);
+        }
+    });
+    for (PatchKey key : stale) {
+        wanted.erase(key);
+    }
+}
+
+void PatchUploader::want(int level, int x, int y) {
+    if (!persistent()) {
+        return;
+    }
+    std::lock_guard lock(mutex);
+    *wanted.insert(packPatchKey(level, x, y), frame).first = frame;
+}
+
+int PatchUploader::freeSlot() const {
+    for (int i = 0; i < int(slots.size()); i++) {
+        if (slots[i].state == SlotState::Free) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void PatchUploader::stage(int level, int x, int y) {
+    if (!persistent()) {
+        return;
+    }
+    const PatchKey key = packPatchKey(level, x, y);
+    int slot;
+    {
+        std::lock_guard lock(mutex);
+        if (wanted.find(key) == nullptr || (slot = freeSlot()) < 0) {
+            return;
+        }
+        wanted.erase(key);
+        slots[slot].state = SlotState::Staging;
+    }
+
+    // copied outside the lock; the slot is ours until it's marked staged
+    const PatchSample* patch = patch_store.acquire(level, x, y);
+    if (patch != nullptr) {
+        patchToRowMajor(patch, edge, patch_store.layout(), slotData(slot));
+        patch_store.unpin(key);
+    }
+
+    std::lock_guard lock(mutex);
+    if (patch == nullptr) {
+        slots[slot].state = SlotState::Free;
+        return;
+    }
+    slots[slot] = {SlotState::Staged, key, frame};
+    staged.insert(key, slot);
+    worker_staged++;
+}
+
+void PatchUploader::upload(int level, int x, int y, const PatchSample* patch, int layer) {
+    const PatchKey key = packPatchKey(level, x, y);
+    const void* pixels = nullptr;
+    GLuint buffer = 0;
+    int slot = -1;
+    if (persistent()) {
+        bool filled = false;
+        {
+            std::lock_guard lock(mutex);
+            wanted.erase(key);
+            if (auto found = staged.find(key)) {
+                slot = *found;
+                filled = true;
+                staged.erase(key);
+            } else if ((slot = freeSlot()) >= 0) {
+                render_staged++;
+            }
+            if (slot >= 0) {
+                slots[slot].state = SlotState::InFlight;
+            }
+        }
+        if (slot >= 0 && !filled) {
+            patchToRowMajor(patch, edge, patch_store.layout(), slotData(slot));
+        }
+        if (slot >= 0) {
+            buffer = ring_buffer;
+            pixels = reinterpret_cast<const void*>(size_t(slot) * slot_stride * sizeof(PatchSample));
+        }
+    } else {
+        // Orphaning gives the slot fresh storage, so the upload still
+        // reading its previous contents needn't be waited on.
+        slot = next_slot;
+        next_slot = (next_slot + 1) % slots.size();
+        buffer = slots[slot].buffer;
+        const auto slot_bytes = GLsizeiptr(slot_stride * sizeof(PatchSample));
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, slot_bytes, nullptr, GL_STREAM_DRAW);
+        auto mapped = static_cast<PatchSample*>(glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, slot_bytes,
+                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+        if (mapped != nullptr) {
+            patchToRowMajor(patch, edge, patch_store.layout(), mapped);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        } else {
+            buffer = 0;
+            slot = -1;
+        }
+    }
+
+    if (slot < 0) {
+        // straight from client memory, which must be row-major
+        direct_uploads++;
+        pixels = patch;
+        if (patch_store.layout() != PatchLayout::RowMajor) {
+            upload_buffer.resize(slot_values);
+            patchToRowMajor(patch, edge, patch_store.layout(), upload_buffer.data());
+            pixels = upload_buffer.data();
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+    // rows of 16-bit RGB texels needn't be a multiple of 4 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+    glTexSubImage3D(
+            GL_TEXTURE_2D_ARRAY, // target
+            0, // mipmap level
+            0, 0, // top-left coord
+            layer, // start layer
+            edge, // width
+            edge, // height
+            1, // layer count (number of layers)
+            GL_RGB, // format
+            PatchTexture<PatchSample>::type,
+            pixels
+    );
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    frame_bytes += slot_values * sizeof(PatchSample);
+
+    if (persistent() && slot >= 0) {
+        std::lock_guard lock(mutex);
+        slots[slot].key = key;
+        slots[slot].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+}
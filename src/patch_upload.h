@@ -0,0 +1,113 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_PATCH_UPLOAD_H
+#define TERRAIN_GL_PATCH_UPLOAD_H
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <GL/glew.h>
+
+#include "patch_index.h"
+#include "patch_store.h"
+#include "terrain_config.h"
+
+// Texture formats for each way patches can be stored
+template<typename T>
+struct PatchTexture;
+
+template<>
+struct PatchTexture<float> {
+    static const GLenum internal_format = GL_RGB32F;
+    static const GLenum type = GL_FLOAT;
+};
+
+template<>
+struct PatchTexture<uint16_t> {
+    static const GLenum internal_format = GL_RGB16;  // normalised, so sampled as 0..1
+    static const GLenum type = GL_UNSIGNED_SHORT;
+};
+
+// Uploads patches to texture array layers through a ring of pixel buffer
+// slots, so glTexSubImage3D() copies from GPU-visible memory without
+// stalling the frame, rather than from client memory.
+//
+// With GL_ARB_buffer_storage the ring is one persistently mapped buffer.
+// A fence after each upload tracks when its slot can be reused, and
+// worker threads stage patches the render thread is waiting on straight
+// into free slots as they finish them (see stage()), so the upload is
+// ready to issue when the patch is first drawn. Without it, each slot is
+// its own buffer, orphaned and mapped on the render thread per upload.
+//
+// Uploads can be held to a budget of bytes per frame, for steadier frame
+// times; it's for callers to check withinBudget() and defer what they can.
+//
+// Every call but stage() must be made on the GL thread.
+class PatchUploader {
+public:
+    PatchUploader(PatchStore<PatchSample>& patch_store, int edge, size_t frame_budget_bytes = SIZE_MAX,
+                  int slot_count = default_slots);
+    PatchUploader(const PatchUploader&) = delete;
+    PatchUploader& operator=(const PatchUploader&) = delete;
+    ~PatchUploader();
+
+    // Frees slots whose uploads the GPU has finished with, and forgets
+    // patches no longer being waited on.
+    void beginFrame();
+    // notes that a patch is wanted on the GPU as soon as it's generated
+    void want(int level, int x, int y);
+    // Copies the patch into a free slot if it's wanted and the ring is
+    // persistently mapped. Safe on any thread, e.g. from a worker which
+    // has just built it.
+    void stage(int level, int x, int y);
+    // Uploads the patch to a layer of the bound GL_TEXTURE_2D_ARRAY, from
+    // its staged slot if it has one
+    void upload(int level, int x, int y, const PatchSample* patch, int layer);
+
+    bool persistent() const { return mapping != nullptr; }
+    // whether this frame's uploads have yet to reach the budget
+    bool withinBudget() const { return frame_bytes < frame_budget_bytes; }
+
+    // counters for the periodic stats output
+    std::atomic<long> worker_staged{0};  // uploads staged by workers
+    std::atomic<long> render_staged{0};  // staged by the render thread at upload
+    std::atomic<long> direct_uploads{0};  // from client memory, as the ring was full
+    std::atomic<long> deferred{0};  // uploads put off by callers as over budget
+private:
+    static const int default_slots = 64;
+    // frames a want() or an unclaimed staged patch lasts
+    static const long keep_frames = 2;
+    static const long staged_frames = 30;
+
+    enum class SlotState { Free, Staging, Staged, InFlight };
+    struct Slot {
+        SlotState state = SlotState::Free;
+        PatchKey key = PatchIndex<int>::empty_key;
+        long frame = 0;  // when staged
+        GLsync fence = nullptr;
+        GLuint buffer = 0;  // own buffer, when not persistently mapped
+    };
+
+    int freeSlot() const;
+    PatchSample* slotData(int slot) const { return mapping + size_t(slot) * slot_stride; }
+
+    PatchStore<PatchSample>& patch_store;
+    int edge;
+    size_t slot_values;
+    size_t frame_budget_bytes;
+    size_t frame_bytes = 0;  // uploaded this frame
+    size_t slot_stride;  // in values, keeping each slot's offset aligned
+    GLuint ring_buffer = 0;
+    PatchSample* mapping = nullptr;
+    int next_slot = 0;  // round robin, when orphaning
+    std::vector<PatchSample> upload_buffer;  // row-major copy for direct uploads
+
+    mutable std::mutex mutex;
+    std::vector<Slot> slots;
+    PatchIndex<long> wanted;  // key -> frame last wanted
+    PatchIndex<int> staged;  // key -> slot
+    long frame = 0;
+};
+
+#endif //TERRAIN_GL_PATCH_UPLOAD_H
@@ -0,0 +1,133 @@
+// terrain_gl
+// @codedstructure 2023
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+
+#include "heightmap.h"
+#include "patch_workers.h"
+
+template<typename T>
+PatchWorkers<T>::PatchWorkers(int thread_count) {
+    for (int i = 0; i < thread_count; i++) {
+        threads.emplace_back(&PatchWorkers<T>::run, this);
+    }
+}
+
+template<typename T>
+PatchWorkers<T>::~PatchWorkers() {
+    stop();
+}
+
+template<typename T>
+int PatchWorkers<T>::defaultThreads() {
+    return std::max(1, int(std::thread::hardware_concurrency()) - 1);
+}
+
+template<typename T>
+void PatchWorkers<T>::request(HeightMap<T>& heightMap, int x, int y, float priority) {
+    auto key = packPatchKey(heightMap.level, x, y);
+    {
+        std::lock_guard lock(mutex);
+        auto [job, inserted] = requested.insert(key, {&heightMap, x, y, priority, frame, false});
+        if (!inserted) {
+            job->frame = frame;
+            if (job->running || std::abs(job->priority - priority) < priority_step) {
+                return;
+            }
+            job->priority = priority;
+        }
+        push(priority, key);
+    }
+    wake.notify_one();
+}
+
+template<typename T>
+void PatchWorkers<T>::push(float priority, PatchKey key) {
+    // Every reprioritisation leaves a stale entry behind, so rebuild the
+    // heap from the live jobs before it gets out of hand.
+    if (queue.size() > 4 * requested.size() + 64) {
+        queue.clear();
+        requested.forEach([this](PatchKey job_key, Job& job) {
+            if (!job.running) {
+                queue.emplace_back(job.priority, job_key);
+            }
+        });
+        std::make_heap(queue.begin(), queue.end(), std::greater<>());
+    }
+    queue.emplace_back(priority, key);
+    std::push_heap(queue.begin(), queue.end(), std::greater<>());
+}
+
+template<typename T>
+void PatchWorkers<T>::beginFrame() {
+    std::lock_guard lock(mutex);
+    frame++;
+}
+
+template<typename T>
+size_t PatchWorkers<T>::pending() const {
+    std::lock_guard lock(mutex);
+    return requested.size();
+}
+
+template<typename T>
+void PatchWorkers<T>::stop() {
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+        queue.clear();
+    }
+    wake.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+}
+
+template<typename T>
+void PatchWorkers<T>::run() {
+    std::unique_lock lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (stopping) {
+            return;
+        }
+        std::pop_heap(queue.begin(), queue.end(), std::greater<>());
+        auto [priority, key] = queue.back();
+        queue.pop_back();
+
+        auto job = requested.find(key);
+        if (job == nullptr || job->running || job->priority != priority) {
+            continue;
+        }
+        if (frame - job->frame > keep_frames) {
+            // no longer wanted: out of range, or out of view for too long
+            requested.erase(key);
+            cancelled++;
+            continue;
+        }
+        job->running = true;
+        Job work = *job;
+
+        lock.unlock();
+        // A request can miss the store just before a worker publishes the
+        // patch and erases its job, queueing it again, so it's checked here
+        // rather than built twice. Jobs stay requested until their patch is
+        // in the store.
+        if (!work.heightMap->patchStored(work.x, work.y)) {
+            work.heightMap->buildPatch(work.x, work.y);
+            if (built) {
+                built(*work.heightMap, work.x, work.y);
+            }
+        }
+        lock.lock();
+        requested.erase(key);
+    }
+}
+
+// explicit instantiation of available types
+template class PatchWorkers<uint16_t>;
+template class PatchWorkers<float>;
@@ -0,0 +1,76 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_PATCH_WORKERS_H
+#define TERRAIN_GL_PATCH_WORKERS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "patch_index.h"
+
+template<typename T>
+class HeightMap;
+
+// Background threads generating HeightMap patches into their shared store,
+// so the render thread never waits on noise. request() only queues work;
+// the patch turns up in the store once a worker has finished it.
+//
+// Queued patches are generated lowest priority value first. Requests are
+// expected to be renewed every frame while the patch is still wanted, with
+// an updated priority; anything not requested again within keep_frames of
+// beginFrame() is dropped rather than generated.
+template<typename T>
+class PatchWorkers {
+public:
+    // by default leaves one core for the render thread
+    explicit PatchWorkers(int thread_count = defaultThreads());
+    ~PatchWorkers();
+
+    // queues a patch, or updates its priority if it's already queued
+    void request(HeightMap<T>& heightMap, int x, int y, float priority);
+    void beginFrame();
+    size_t pending() const;
+    // Called on the worker thread with each patch it finishes, e.g. to
+    // stage it for upload. Must be set before the first request().
+    void onBuilt(std::function<void(HeightMap<T>& heightMap, int x, int y)> callback) { built = std::move(callback); }
+    void stop();
+
+    static int defaultThreads();
+
+    std::atomic<long> cancelled{0};
+private:
+    static const long keep_frames = 2;
+    // changes smaller than this don't requeue a request
+    static constexpr float priority_step = 0.25f;
+
+    struct Job {
+        HeightMap<T>* heightMap;
+        int x, y;
+        float priority;
+        long frame;  // last requested
+        bool running;
+    };
+    // (priority, key), kept as a min-heap; entries whose priority no longer
+    // matches their job are stale and skipped
+    using QueueEntry = std::pair<float, PatchKey>;
+
+    void push(float priority, PatchKey key);
+    void run();
+
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    std::vector<QueueEntry> queue;
+    PatchIndex<Job> requested;  // queued or in progress
+    long frame = 0;
+    bool stopping = false;
+    std::vector<std::thread> threads;
+    std::function<void(HeightMap<T>&, int, int)> built;
+};
+
+#endif //TERRAIN_GL_PATCH_WORKERS_H
@@ -1,5 +1,6 @@
 // Derived from https://weber.itn.liu.se/~stegu/aqsis/aqsis-newnoise/simplexnoise1234.h
-// Changes are to address compiler warnings
+// Changes are to address compiler warnings, and to add batched 2D
+// evaluation and analytic derivatives (see simplexnoise1234_batch.cpp)
 
 #ifndef TERRAIN_GL_SIMPLEXNOISE1234_H
 #define TERRAIN_GL_SIMPLEXNOISE1234_H
@@ -56,8 +57,23 @@ public:
     static float noise( float x, float y, float z, float w,
                                            int px, int py, int pz, int pw );
 
+/** 2D float Perlin noise over arrays of coordinates: out[i] = noise(x[i], y[i]).
+ * Results are bit-identical to the scalar version; SSE4.1/AVX2/AVX-512
+ * kernels are used when the CPU supports them.
+ */
+    static void noise( const float* x, const float* y, float* out, int count );
+    static const char* batchKernelName();
+
+/** 2D float Perlin noise with its analytic gradient, singly and over arrays.
+ * The noise values are identical to those from noise(x, y).
+ */
+    static float noise( float x, float y, float* dnoise_dx, float* dnoise_dy );
+    static void noise( const float* x, const float* y, float* out,
+                       float* dnoise_dx, float* dnoise_dy, int count );
+
 private:
     static unsigned char perm[];
+    static const int* perm32();
     static float  grad( int hash, float x );
     static float  grad( int hash, float x, float y );
     static float  grad( int hash, float x, float y , float z );
@@ -0,0 +1,454 @@
+// terrain_gl
+// @codedstructure 2023
+
+// Batched 2D simplex noise, and 2D noise with analytic derivatives.
+//
+// Each kernel is a lane-wise transcription of SimplexNoise1234::noise(x, y),
+// keeping the same operations in the same order so results are bit-identical
+// to the scalar code. This file must be compiled without floating point
+// contraction (see CMakeLists.txt), otherwise a mul+add pair may be fused in
+// one version and not the other.
+//
+// Derivatives: each corner contributes t^4 * (g . d), with t = 0.5 - |d|^2
+// and d the offset from the corner, so its partial derivative along x is
+// -8 * t^3 * d.x * (g . d) + t^4 * g.x (and likewise for y).
+
+#include <array>
+
+#include "simplexnoise1234.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define TERRAIN_GL_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#define FASTFLOOR(x) ( ((x)>0) ? ((int)x) : (((int)x)-1) )
+
+namespace {
+
+const float F2 = 0.366025403f; // F2 = 0.5*(sqrt(3.0)-1.0)
+const float G2 = 0.211324865f; // G2 = (3.0-Math.sqrt(3.0))/6.0
+
+using BatchFn = void (*)(const float*, const float*, float*, float*, float*, int, int, const int*);
+
+struct BatchKernel {
+    const char* name;
+    BatchFn fn;
+    BatchFn fn_derivatives;
+};
+
+void noise2Scalar(const float* x, const float* y, float* out, float*, float*, int start, int count, const int*) {
+    for (int n = start; n < count; n++) {
+        out[n] = SimplexNoise1234::noise(x[n], y[n]);
+    }
+}
+
+void noise2ScalarDerivatives(const float* x, const float* y, float* out, float* dx, float* dy,
+                             int start, int count, const int*) {
+    for (int n = start; n < count; n++) {
+        out[n] = SimplexNoise1234::noise(x[n], y[n], &dx[n], &dy[n]);
+    }
+}
+
+template<bool Derivatives>
+void noise2ScalarTail(const float* x, const float* y, float* out, float* dx, float* dy,
+                      int start, int count, const int* perm) {
+    if (Derivatives) {
+        noise2ScalarDerivatives(x, y, out, dx, dy, start, count, perm);
+    } else {
+        noise2Scalar(x, y, out, dx, dy, start, count, perm);
+    }
+}
+
+#ifdef TERRAIN_GL_X86_KERNELS
+
+// The gradient for a hash is (u, 2v) along (x, y) for h<4, or along (y, x)
+// otherwise, with (h&1) and (h&2) flipping the signs of u and v.
+
+template<bool Derivatives>
+__attribute__((target("sse4.1")))
+__m128 corner2SSE41(__m128 x, __m128 y, __m128i hash, __m128& dx, __m128& dy) {
+    __m128i h = _mm_and_si128(hash, _mm_set1_epi32(7));
+    __m128 lt4 = _mm_castsi128_ps(_mm_cmplt_epi32(h, _mm_set1_epi32(4)));
+    __m128 u_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(1)), 31));
+    __m128 v_sign = _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(2)), 30));
+    __m128 u = _mm_blendv_ps(y, x, lt4);
+    __m128 v = _mm_blendv_ps(x, y, lt4);
+    __m128 v2 = _mm_mul_ps(_mm_set1_ps(2.0f), v);
+    __m128 grad = _mm_add_ps(_mm_xor_ps(u, u_sign), _mm_xor_ps(v2, v_sign));
+
+    __m128 t = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(0.5f), _mm_mul_ps(x, x)), _mm_mul_ps(y, y));
+    __m128 outside = _mm_cmplt_ps(t, _mm_setzero_ps());
+    __m128 t2 = _mm_mul_ps(t, t);
+    __m128 t4 = _mm_mul_ps(t2, t2);
+    if (Derivatives) {
+        __m128 gu = _mm_xor_ps(_mm_set1_ps(1.0f), u_sign);
+        __m128 gv = _mm_xor_ps(_mm_set1_ps(2.0f), v_sign);
+        __m128 gx = _mm_blendv_ps(gv, gu, lt4);
+        __m128 gy = _mm_blendv_ps(gu, gv, lt4);
+        __m128 d = _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(-8.0f), _mm_mul_ps(t2, t)), grad);
+        dx = _mm_andnot_ps(outside, _mm_add_ps(_mm_mul_ps(d, x), _mm_mul_ps(t4, gx)));
+        dy = _mm_andnot_ps(outside, _mm_add_ps(_mm_mul_ps(d, y), _mm_mul_ps(t4, gy)));
+    }
+    return _mm_andnot_ps(outside, _mm_mul_ps(t4, grad));
+}
+
+__attribute__((target("sse4.1")))
+__m128i fastFloorSSE41(__m128 v) {
+    // ((v)>0) ? ((int)v) : (((int)v)-1)
+    __m128i truncated = _mm_cvttps_epi32(v);
+    __m128i positive = _mm_castps_si128(_mm_cmpgt_ps(v, _mm_setzero_ps()));
+    return _mm_sub_epi32(_mm_sub_epi32(truncated, _mm_set1_epi32(1)), positive);
+}
+
+template<bool Derivatives>
+__attribute__((target("sse4.1")))
+void noise2SSE41(const float* xp, const float* yp, float* out, float* dxp, float* dyp,
+                 int start, int count, const int* perm) {
+    alignas(16) int idx[4];
+    alignas(16) int hash[4];
+    int n = start;
+    for (; n + 4 <= count; n += 4) {
+        __m128 x = _mm_loadu_ps(xp + n);
+        __m128 y = _mm_loadu_ps(yp + n);
+
+        __m128 s = _mm_mul_ps(_mm_add_ps(x, y), _mm_set1_ps(F2));
+        __m128i i = fastFloorSSE41(_mm_add_ps(x, s));
+        __m128i j = fastFloorSSE41(_mm_add_ps(y, s));
+
+        __m128 t = _mm_mul_ps(_mm_cvtepi32_ps(_mm_add_epi32(i, j)), _mm_set1_ps(G2));
+        __m128 x0 = _mm_sub_ps(x, _mm_sub_ps(_mm_cvtepi32_ps(i), t));
+        __m128 y0 = _mm_sub_ps(y, _mm_sub_ps(_mm_cvtepi32_ps(j), t));
+
+        __m128 lower = _mm_cmpgt_ps(x0, y0);
+        __m128 i1 = _mm_and_ps(lower, _mm_set1_ps(1.0f));
+        __m128 j1 = _mm_andnot_ps(lower, _mm_set1_ps(1.0f));
+
+        __m128 x1 = _mm_add_ps(_mm_sub_ps(x0, i1), _mm_set1_ps(G2));
+        __m128 y1 = _mm_add_ps(_mm_sub_ps(y0, j1), _mm_set1_ps(G2));
+        __m128 x2 = _mm_add_ps(_mm_sub_ps(x0, _mm_set1_ps(1.0f)), _mm_set1_ps(2.0f * G2));
+        __m128 y2 = _mm_add_ps(_mm_sub_ps(y0, _mm_set1_ps(1.0f)), _mm_set1_ps(2.0f * G2));
+
+        const __m128i mask = _mm_set1_epi32(0xff);
+        const __m128i one = _mm_set1_epi32(1);
+        __m128i ii = _mm_and_si128(i, mask);
+        __m128i jj = _mm_and_si128(j, mask);
+        __m128i i1i = _mm_cvtps_epi32(i1);
+        __m128i j1i = _mm_cvtps_epi32(j1);
+
+        // No gather before AVX2, so the permutation lookups are done per lane
+        __m128i hashes[3];
+        const __m128i offsets_i[3] = {_mm_setzero_si128(), i1i, one};
+        const __m128i offsets_j[3] = {_mm_setzero_si128(), j1i, one};
+        for (int c = 0; c < 3; c++) {
+            _mm_store_si128(reinterpret_cast<__m128i*>(idx), _mm_add_epi32(jj, offsets_j[c]));
+            for (int lane = 0; lane < 4; lane++) {
+                idx[lane] = perm[idx[lane]];
+            }
+            __m128i inner = _mm_load_si128(reinterpret_cast<const __m128i*>(idx));
+            _mm_store_si128(reinterpret_cast<__m128i*>(idx), _mm_add_epi32(_mm_add_epi32(ii, offsets_i[c]), inner));
+            for (int lane = 0; lane < 4; lane++) {
+                hash[lane] = perm[idx[lane]];
+            }
+            hashes[c] = _mm_load_si128(reinterpret_cast<const __m128i*>(hash));
+        }
+
+        __m128 dx0, dy0, dx1, dy1, dx2, dy2;
+        __m128 n0 = corner2SSE41<Derivatives>(x0, y0, hashes[0], dx0, dy0);
+        __m128 n1 = corner2SSE41<Derivatives>(x1, y1, hashes[1], dx1, dy1);
+        __m128 n2 = corner2SSE41<Derivatives>(x2, y2, hashes[2], dx2, dy2);
+
+        const __m128 scale = _mm_set1_ps(40.0f);
+        _mm_storeu_ps(out + n, _mm_mul_ps(scale, _mm_add_ps(_mm_add_ps(n0, n1), n2)));
+        if (Derivatives) {
+            _mm_storeu_ps(dxp + n, _mm_mul_ps(scale, _mm_add_ps(_mm_add_ps(dx0, dx1), dx2)));
+            _mm_storeu_ps(dyp + n, _mm_mul_ps(scale, _mm_add_ps(_mm_add_ps(dy0, dy1), dy2)));
+        }
+    }
+    noise2ScalarTail<Derivatives>(xp, yp, out, dxp, dyp, n, count, perm);
+}
+
+template<bool Derivatives>
+__attribute__((target("avx2")))
+__m256 corner2AVX2(__m256 x, __m256 y, __m256i hash, __m256& dx, __m256& dy) {
+    __m256i h = _mm256_and_si256(hash, _mm256_set1_epi32(7));
+    __m256 lt4 = _mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_set1_epi32(4), h));
+    __m256 u_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(1)), 31));
+    __m256 v_sign = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(2)), 30));
+    __m256 u = _mm256_blendv_ps(y, x, lt4);
+    __m256 v = _mm256_blendv_ps(x, y, lt4);
+    __m256 v2 = _mm256_mul_ps(_mm256_set1_ps(2.0f), v);
+    __m256 grad = _mm256_add_ps(_mm256_xor_ps(u, u_sign), _mm256_xor_ps(v2, v_sign));
+
+    __m256 t = _mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(0.5f), _mm256_mul_ps(x, x)), _mm256_mul_ps(y, y));
+    __m256 outside = _mm256_cmp_ps(t, _mm256_setzero_ps(), _CMP_LT_OQ);
+    __m256 t2 = _mm256_mul_ps(t, t);
+    __m256 t4 = _mm256_mul_ps(t2, t2);
+    if (Derivatives) {
+        __m256 gu = _mm256_xor_ps(_mm256_set1_ps(1.0f), u_sign);
+        __m256 gv = _mm256_xor_ps(_mm256_set1_ps(2.0f), v_sign);
+        __m256 gx = _mm256_blendv_ps(gv, gu, lt4);
+        __m256 gy = _mm256_blendv_ps(gu, gv, lt4);
+        __m256 d = _mm256_mul_ps(_mm256_mul_ps(_mm256_set1_ps(-8.0f), _mm256_mul_ps(t2, t)), grad);
+        dx = _mm256_andnot_ps(outside, _mm256_add_ps(_mm256_mul_ps(d, x), _mm256_mul_ps(t4, gx)));
+        dy = _mm256_andnot_ps(outside, _mm256_add_ps(_mm256_mul_ps(d, y), _mm256_mul_ps(t4, gy)));
+    }
+    return _mm256_andnot_ps(outside, _mm256_mul_ps(t4, grad));
+}
+
+__attribute__((target("avx2")))
+__m256i fastFloorAVX2(__m256 v) {
+    __m256i truncated = _mm256_cvttps_epi32(v);
+    __m256i positive = _mm256_castps_si256(_mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GT_OQ));
+    return _mm256_sub_epi32(_mm256_sub_epi32(truncated, _mm256_set1_epi32(1)), positive);
+}
+
+template<bool Derivatives>
+__attribute__((target("avx2")))
+void noise2AVX2(const float* xp, const float* yp, float* out, float* dxp, float* dyp,
+                int start, int count, const int* perm) {
+    int n = start;
+    for (; n + 8 <= count; n += 8) {
+        __m256 x = _mm256_loadu_ps(xp + n);
+        __m256 y = _mm256_loadu_ps(yp + n);
+
+        __m256 s = _mm256_mul_ps(_mm256_add_ps(x, y), _mm256_set1_ps(F2));
+        __m256i i = fastFloorAVX2(_mm256_add_ps(x, s));
+        __m256i j = fastFloorAVX2(_mm256_add_ps(y, s));
+
+        __m256 t = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(i, j)), _mm256_set1_ps(G2));
+        __m256 x0 = _mm256_sub_ps(x, _mm256_sub_ps(_mm256_cvtepi32_ps(i), t));
+        __m256 y0 = _mm256_sub_ps(y, _mm256_sub_ps(_mm256_cvtepi32_ps(j), t));
+
+        __m256 lower = _mm256_cmp_ps(x0, y0, _CMP_GT_OQ);
+        __m256 i1 = _mm256_and_ps(lower, _mm256_set1_ps(1.0f));
+        __m256 j1 = _mm256_andnot_ps(lower, _mm256_set1_ps(1.0f));
+
+        __m256 x1 = _mm256_add_ps(_mm256_sub_ps(x0, i1), _mm256_set1_ps(G2));
+        __m256 y1 = _mm256_add_ps(_mm256_sub_ps(y0, j1), _mm256_set1_ps(G2));
+        __m256 x2 = _mm256_add_ps(_mm256_sub_ps(x0, _mm256_set1_ps(1.0f)), _mm256_set1_ps(2.0f * G2));
+        __m256 y2 = _mm256_add_ps(_mm256_sub_ps(y0, _mm256_set1_ps(1.0f)), _mm256_set1_ps(2.0f * G2));
+
+        const __m256i mask = _mm256_set1_epi32(0xff);
+        const __m256i one = _mm256_set1_epi32(1);
+        __m256i ii = _mm256_and_si256(i, mask);
+        __m256i jj = _mm256_and_si256(j, mask);
+        __m256i i1i = _mm256_cvtps_epi32(i1);
+        __m256i j1i = _mm256_cvtps_epi32(j1);
+
+        __m256i h0 = _mm256_i32gather_epi32(perm, _mm256_add_epi32(ii, _mm256_i32gather_epi32(perm, jj, 4)), 4);
+        __m256i h1 = _mm256_i32gather_epi32(perm, _mm256_add_epi32(_mm256_add_epi32(ii, i1i),
+                _mm256_i32gather_epi32(perm, _mm256_add_epi32(jj, j1i), 4)), 4);
+        __m256i h2 = _mm256_i32gather_epi32(perm, _mm256_add_epi32(_mm256_add_epi32(ii, one),
+                _mm256_i32gather_epi32(perm, _mm256_add_epi32(jj, one), 4)), 4);
+
+        __m256 dx0, dy0, dx1, dy1, dx2, dy2;
+        __m256 n0 = corner2AVX2<Derivatives>(x0, y0, h0, dx0, dy0);
+        __m256 n1 = corner2AVX2<Derivatives>(x1, y1, h1, dx1, dy1);
+        __m256 n2 = corner2AVX2<Derivatives>(x2, y2, h2, dx2, dy2);
+
+        const __m256 scale = _mm256_set1_ps(40.0f);
+        _mm256_storeu_ps(out + n, _mm256_mul_ps(scale, _mm256_add_ps(_mm256_add_ps(n0, n1), n2)));
+        if (Derivatives) {
+            _mm256_storeu_ps(dxp + n, _mm256_mul_ps(scale, _mm256_add_ps(_mm256_add_ps(dx0, dx1), dx2)));
+            _mm256_storeu_ps(dyp + n, _mm256_mul_ps(scale, _mm256_add_ps(_mm256_add_ps(dy0, dy1), dy2)));
+        }
+    }
+    noise2ScalarTail<Derivatives>(xp, yp, out, dxp, dyp, n, count, perm);
+}
+
+// avx512f has no float xor/blendv, so signs are flipped as integers and
+// selections are done with mask registers.
+template<bool Derivatives>
+__attribute__((target("avx512f")))
+__m512 corner2AVX512(__m512 x, __m512 y, __m512i hash, __m512& dx, __m512& dy) {
+    __m512i h = _mm512_and_si512(hash, _mm512_set1_epi32(7));
+    __mmask16 lt4 = _mm512_cmplt_epi32_mask(h, _mm512_set1_epi32(4));
+    __m512i u_sign = _mm512_slli_epi32(_mm512_and_si512(h, _mm512_set1_epi32(1)), 31);
+    __m512i v_sign = _mm512_slli_epi32(_mm512_and_si512(h, _mm512_set1_epi32(2)), 30);
+    __m512 u = _mm512_mask_blend_ps(lt4, y, x);
+    __m512 v = _mm512_mask_blend_ps(lt4, x, y);
+    __m512 v2 = _mm512_mul_ps(_mm512_set1_ps(2.0f), v);
+    __m512 su = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(u), u_sign));
+    __m512 sv = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(v2), v_sign));
+    __m512 grad = _mm512_add_ps(su, sv);
+
+    __m512 t = _mm512_sub_ps(_mm512_sub_ps(_mm512_set1_ps(0.5f), _mm512_mul_ps(x, x)), _mm512_mul_ps(y, y));
+    __mmask16 inside = _mm512_cmp_ps_mask(t, _mm512_setzero_ps(), _CMP_NLT_UQ);
+    __m512 t2 = _mm512_mul_ps(t, t);
+    __m512 t4 = _mm512_mul_ps(t2, t2);
+    if (Derivatives) {
+        __m512 gu = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(_mm512_set1_ps(1.0f)), u_sign));
+        __m512 gv = _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(_mm512_set1_ps(2.0f)), v_sign));
+        __m512 gx = _mm512_mask_blend_ps(lt4, gv, gu);
+        __m512 gy = _mm512_mask_blend_ps(lt4, gu, gv);
+        __m512 d = _mm512_mul_ps(_mm512_mul_ps(_mm512_set1_ps(-8.0f), _mm512_mul_ps(t2, t)), grad);
+        dx = _mm512_maskz_mov_ps(inside, _mm512_add_ps(_mm512_mul_ps(d, x), _mm512_mul_ps(t4, gx)));
+        dy = _mm512_maskz_mov_ps(inside, _mm512_add_ps(_mm512_mul_ps(d, y), _mm512_mul_ps(t4, gy)));
+    }
+    return _mm512_maskz_mov_ps(inside, _mm512_mul_ps(t4, grad));
+}
+
+__attribute__((target("avx512f")))
+__m512i fastFloorAVX512(__m512 v) {
+    __m512i truncated = _mm512_cvttps_epi32(v);
+    __mmask16 positive = _mm512_cmp_ps_mask(v, _mm512_setzero_ps(), _CMP_GT_OQ);
+    return _mm512_mask_sub_epi32(truncated, static_cast<__mmask16>(~positive), truncated, _mm512_set1_epi32(1));
+}
+
+template<bool Derivatives>
+__attribute__((target("avx512f")))
+void noise2AVX512(const float* xp, const float* yp, float* out, float* dxp, float* dyp,
+                  int start, int count, const int* perm) {
+    int n = start;
+    for (; n + 16 <= count; n += 16) {
+        __m512 x = _mm512_loadu_ps(xp + n);
+        __m512 y = _mm512_loadu_ps(yp + n);
+
+        __m512 s = _mm512_mul_ps(_mm512_add_ps(x, y), _mm512_set1_ps(F2));
+        __m512i i = fastFloorAVX512(_mm512_add_ps(x, s));
+        __m512i j = fastFloorAVX512(_mm512_add_ps(y, s));
+
+        __m512 t = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_add_epi32(i, j)), _mm512_set1_ps(G2));
+        __m512 x0 = _mm512_sub_ps(x, _mm512_sub_ps(_mm512_cvtepi32_ps(i), t));
+        __m512 y0 = _mm512_sub_ps(y, _mm512_sub_ps(_mm512_cvtepi32_ps(j), t));
+
+        __mmask16 lower = _mm512_cmp_ps_mask(x0, y0, _CMP_GT_OQ);
+        __m512 i1 = _mm512_maskz_mov_ps(lower, _mm512_set1_ps(1.0f));
+        __m512 j1 = _mm512_maskz_mov_ps(static_cast<__mmask16>(~lower), _mm512_set1_ps(1.0f));
+
+        __m512 x1 = _mm512_add_ps(_mm512_sub_ps(x0, i1), _mm512_set1_ps(G2));
+        __m512 y1 = _mm512_add_ps(_mm512_sub_ps(y0, j1), _mm512_set1_ps(G2));
+        __m512 x2 = _mm512_add_ps(_mm512_sub_ps(x0, _mm512_set1_ps(1.0f)), _mm512_set1_ps(2.0f * G2));
+        __m512 y2 = _mm512_add_ps(_mm512_sub_ps(y0, _mm512_set1_ps(1.0f)), _mm512_set1_ps(2.0f * G2));
+
+        const __m512i mask = _mm512_set1_epi32(0xff);
+        const __m512i one = _mm512_set1_epi32(1);
+        __m512i ii = _mm512_and_si512(i, mask);
+        __m512i jj = _mm512_and_si512(j, mask);
+        __m512i i1i = _mm512_maskz_mov_epi32(lower, one);
+        __m512i j1i = _mm512_maskz_mov_epi32(static_cast<__mmask16>(~lower), one);
+
+        __m512i h0 = _mm512_i32gather_epi32(_mm512_add_epi32(ii, _mm512_i32gather_epi32(jj, perm, 4)), perm, 4);
+        __m512i h1 = _mm512_i32gather_epi32(_mm512_add_epi32(_mm512_add_epi32(ii, i1i),
+                _mm512_i32gather_epi32(_mm512_add_epi32(jj, j1i), perm, 4)), perm, 4);
+        __m512i h2 = _mm512_i32gather_epi32(_mm512_add_epi32(_mm512_add_epi32(ii, one),
+                _mm512_i32gather_epi32(_mm512_add_epi32(jj, one), perm, 4)), perm, 4);
+
+        __m512 dx0, dy0, dx1, dy1, dx2, dy2;
+        __m512 n0 = corner2AVX512<Derivatives>(x0, y0, h0, dx0, dy0);
+        __m512 n1 = corner2AVX512<Derivatives>(x1, y1, h1, dx1, dy1);
+        __m512 n2 = corner2AVX512<Derivatives>(x2, y2, h2, dx2, dy2);
+
+        const __m512 scale = _mm512_set1_ps(40.0f);
+        _mm512_storeu_ps(out + n, _mm512_mul_ps(scale, _mm512_add_ps(_mm512_add_ps(n0, n1), n2)));
+        if (Derivatives) {
+            _mm512_storeu_ps(dxp + n, _mm512_mul_ps(scale, _mm512_add_ps(_mm512_add_ps(dx0, dx1), dx2)));
+            _mm512_storeu_ps(dyp + n, _mm512_mul_ps(scale, _mm512_add_ps(_mm512_add_ps(dy0, dy1), dy2)));
+        }
+    }
+    noise2ScalarTail<Derivatives>(xp, yp, out, dxp, dyp, n, count, perm);
+}
+
+#endif // TERRAIN_GL_X86_KERNELS
+
+BatchKernel selectBatchKernel() {
+#ifdef TERRAIN_GL_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        return {"avx512", noise2AVX512<false>, noise2AVX512<true>};
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", noise2AVX2<false>, noise2AVX2<true>};
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        return {"sse4.1", noise2SSE41<false>, noise2SSE41<true>};
+    }
+#endif
+    return {"scalar", noise2Scalar, noise2ScalarDerivatives};
+}
+
+const BatchKernel& batchKernel() {
+    static const BatchKernel kernel = selectBatchKernel();
+    return kernel;
+}
+
+} // namespace
+
+// The kernels gather 32-bit lanes, so the permutation table is widened once.
+const int* SimplexNoise1234::perm32() {
+    static const std::array<int, 512> table = [] {
+        std::array<int, 512> widened{};
+        for (int i = 0; i < 512; i++) {
+            widened[i] = perm[i];
+        }
+        return widened;
+    }();
+    return table.data();
+}
+
+void SimplexNoise1234::noise(const float* x, const float* y, float* out, int count) {
+    batchKernel().fn(x, y, out, nullptr, nullptr, 0, count, perm32());
+}
+
+void SimplexNoise1234::noise(const float* x, const float* y, float* out, float* dnoise_dx, float* dnoise_dy, int count) {
+    batchKernel().fn_derivatives(x, y, out, dnoise_dx, dnoise_dy, 0, count, perm32());
+}
+
+const char* SimplexNoise1234::batchKernelName() {
+    return batchKernel().name;
+}
+
+// 2D simplex noise with analytic derivatives. The noise value is computed
+// exactly as noise(x, y) computes it.
+float SimplexNoise1234::noise(float x, float y, float* dnoise_dx, float* dnoise_dy) {
+    float s = (x+y)*F2;
+    float xs = x + s;
+    float ys = y + s;
+    int i = FASTFLOOR(xs);
+    int j = FASTFLOOR(ys);
+
+    float t = (float)(i+j)*G2;
+    float X0 = i-t;
+    float Y0 = j-t;
+    float x0 = x-X0;
+    float y0 = y-Y0;
+
+    int i1, j1;
+    if(x0>y0) {i1=1; j1=0;}
+    else {i1=0; j1=1;}
+
+    const float corner_x[3] = {x0, x0 - i1 + G2, x0 - 1.0f + 2.0f * G2};
+    const float corner_y[3] = {y0, y0 - j1 + G2, y0 - 1.0f + 2.0f * G2};
+
+    int ii = i & 0xff;
+    int jj = j & 0xff;
+    const int hashes[3] = {perm[ii+perm[jj]], perm[ii+i1+perm[jj+j1]], perm[ii+1+perm[jj+1]]};
+
+    float n[3], dx[3], dy[3];
+    for (int c = 0; c < 3; c++) {
+        float cx = corner_x[c];
+        float cy = corner_y[c];
+        float tc = 0.5f - cx*cx-cy*cy;
+        if (tc < 0.0f) {
+            n[c] = dx[c] = dy[c] = 0.0f;
+            continue;
+        }
+        int h = hashes[c] & 7;
+        float gu = (h&1) ? -1.0f : 1.0f;
+        float gv = (h&2) ? -2.0f : 2.0f;
+        float gx = h<4 ? gu : gv;
+        float gy = h<4 ? gv : gu;
+        float g = grad(hashes[c], cx, cy);
+        float t2 = tc * tc;
+        float t4 = t2 * t2;
+        float d = -8.0f * (t2 * tc) * g;
+        n[c] = t4 * g;
+        dx[c] = d * cx + t4 * gx;
+        dy[c] = d * cy + t4 * gy;
+    }
+
+    *dnoise_dx = 40.0f * (dx[0] + dx[1] + dx[2]);
+    *dnoise_dy = 40.0f * (dy[0] + dy[1] + dy[2]);
+    return 40.0f * (n[0] + n[1] + n[2]);
+}
@@ -1,52 +1,37 @@
 // terrain_gl
 // @codedstructure 2023
 
+#include <algorithm>
+#include <tuple>
 #include <vector>
 #include <GL/glew.h>
 
 #include "terrain.h"
 
 
-Terrain::Terrain(int level, int render_distance, ShaderProgram& program, Terrain* next_level_down) :
+Terrain::Terrain(int level, int render_distance, ShaderProgram& program, PatchStore<PatchSample>& patch_store,
+                 PatchWorkers<PatchSample>& patch_workers, PatchUploader& patch_uploader, PatchLayers& patch_layers,
+                 Terrain* next_level_down, const HeightSource* height_source) :
         render_distance(render_distance),
-        // 0->1, 1->9, 2->25, 3->49, 4->81, etc
-        layer_count(256), //((2 * render_distance) + 1) * ((2 * render_distance) + 1)),
-        heightMap(grid_size, grid_scale, level),
+        heightMap(grid_size, grid_scale, level, patch_store, octave_fill, &patch_workers, height_source),
+        patch_store(patch_store),
+        patch_uploader(patch_uploader),
+        patch_layers(patch_layers),
+        adapted(patchEdge(grid_size)),
         level(level),
-        texId(0),
-        next_terrain(next_level_down)
+        next_terrain(next_level_down),
+        parent_terrain(nullptr)
 {
+    if (next_terrain != nullptr) {
+        next_terrain->parent_terrain = this;
+    }
     layer_location = program.uniformLocation("u_layer");
     level_factor_location = program.uniformLocation("u_level_factor");
     grid_offset_location = program.uniformLocation("u_grid_offset");
-
-    //static_assert(layer_count <= 256);  // OpenGL implementations must support at least 256 layers in 2D array textures
-    glGenTextures(1, &texId);
-    glBindTexture(GL_TEXTURE_2D_ARRAY, texId);
-    glTexParameteri ( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR );
-    glTexParameteri ( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR );
-    // Constant border to exacerbate edge effects - we want to deal with them internally and
-    // never hit the edge here.
-    // TODO: consider REPEAT vs CONSTANT_BORDER
-    glTexParameteri ( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CONSTANT_BORDER );
-    glTexParameteri ( GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CONSTANT_BORDER );
-    // The texture is calculated at a larger size than the rendered patch,
-    // and the texture coordinates are shifted towards the centre of the
-    // texture and reduce edge-effects. Needs to tie up with heightmap
-    // generation and the vertex shader...
-    adapted = grid_size * 1.25 + 1;
-    glTexImage3D(
-            GL_TEXTURE_2D_ARRAY, // target
-            0, // mipmap level
-            GL_R32F, // internal format
-            adapted, // width
-            adapted, // height
-            layer_count, // depth (number of layers)
-            0, // border
-            GL_RED, // format
-            GL_FLOAT,
-            nullptr
-    );
+    tex_offset_location = program.uniformLocation("u_tex_offset");
+    tex_scale_location = program.uniformLocation("u_tex_scale");
+    patch_offset_location = program.uniformLocation("u_patch_offset");
+    patch_range_location = program.uniformLocation("u_patch_range");
 
     // Index buffer for base grid
     glGenBuffers(1, &indicesIBO);
@@ -70,60 +55,83 @@ Terrain::Terrain(int level, int render_distance, ShaderProgram& program, Terrain
 
 void Terrain::start_drawing() const {
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D_ARRAY, texId);
+    patch_layers.bind();
     glBindBuffer(GL_ARRAY_BUFFER, positionVBO);
     glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3*sizeof(GLfloat), nullptr);
     glEnableVertexAttribArray(0);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indicesIBO);
 }
 
-int Terrain::draw_patch(int grid_x, int grid_y) {
-    auto layer_idx = 0;
-    auto layer = grid_layer_map.find({grid_x, grid_y});
-    if (layer != grid_layer_map.end()) {
-        layer_idx = layer->second;
-    } else {
-        // 1. find patch to replace
-        // yup, this seems awful, but it does the job reasonably well.
-        // (minor concession: ignore the least-random low-order bits)
-        auto replace_layer = (rand() >> 8) % layer_count;
-
-        // 2. create new patch for grid_x, grid_y and update texture array
-        glTexSubImage3D(
-                GL_TEXTURE_2D_ARRAY, // target
-                0, // mipmap level
-                0, 0, // top-left coord
-                replace_layer, // start layer
-                adapted, // width
-                adapted, // height
-                1, // layer count (number of layers)
-                GL_RED, // format
-                GL_FLOAT,
-                &heightMap.getPatchFor(grid_x, grid_y)[0]
-        );
+// Returns the texture layer holding patch (grid_x, grid_y), uploading it
+// if it's been generated since last asked for. Returns -1 while it's still
+// being generated, having (re)queued it at the given priority.
+int Terrain::draw_patch(int grid_x, int grid_y, float priority) {
+    auto key = packPatchKey(level, grid_x, grid_y);
+    auto layer_idx = patch_layers.residency.find(key);
+    if (layer_idx < 0) {
+        // 1. get the patch, if it's ready - it comes pinned in the store,
+        // and stays pinned while it's resident on the GPU
+        auto patch = heightMap.requestPatch(grid_x, grid_y, priority);
+        if (patch == nullptr) {
+            // so the worker finishing it stages it for upload
+            patch_uploader.want(level, grid_x, grid_y);
+            return -1;
+        }
+        // Past this frame's upload budget, the parent level stands in until
+        // a later frame. The top level has nothing to stand in for it, so
+        // is always uploaded.
+        if (parent_terrain != nullptr && !patch_uploader.withinBudget()) {
+            patch_store.unpin(key);
+            patch_uploader.deferred++;
+            return -1;
+        }
+
+        // 2. find a layer for it, from any level: the least recently drawn,
+        // unless every layer is in view this frame, when the parent level
+        // stands in
+        PatchKey evicted;
+        layer_idx = patch_layers.residency.allocate(key, evicted);
+        if (layer_idx < 0) {
+            patch_store.unpin(key);
+            return -1;
+        }
 
-        // 3. update the heightmap index arrays
-        auto grid = layer_grid_map[replace_layer];
-        grid_layer_map.erase(grid);
-        grid_layer_map[{grid_x, grid_y}] = replace_layer;
-        layer_grid_map[replace_layer] = {grid_x, grid_y};
-        layer_idx = replace_layer;
+        // 3. update texture array with the new patch, through the upload ring
+        patch_layers.bind();
+        patch_uploader.upload(level, grid_x, grid_y, patch, layer_idx);
+        patch_layers.quantization[layer_idx] = patchQuantization(patch, size_t(adapted) * adapted * patch_channels);
+
+        // 4. the evicted patch no longer needs to stay in the store
+        if (evicted != LayerResidency::empty_key) {
+            patch_store.unpin(evicted);
+        }
     }
     return layer_idx;
 }
 
+
+// Generation priority for one of this level's patches; lower is sooner.
+float Terrain::patch_priority(glm::vec3 player_pos, glm::vec2 grid_offset, bool in_view) const {
+    // Distance is in this level's patch widths, so each level's nearest
+    // patches are equally urgent. Coarser levels then win ties, as they
+    // stand in for finer patches that aren't ready.
+    glm::vec2 centre = grid_offset + glm::vec2(0.5f * heightMap.level_factor);
+    float distance = glm::length(glm::vec2(player_pos.x, player_pos.z) - centre) / heightMap.level_factor;
+    float priority = distance - 0.5f * level;
+    // behind everything in view, but still wanted in case the player turns
+    return in_view ? priority : priority + 4 * render_distance;
+}
+
 int floor_mult(float x, int mult) {
     // round down to multiple of mult
     return floor(x / mult) * mult;
 }
 
-unsigned long Terrain::render_terrain_top_level(glm::vec3 player_pos, glm::vec3 player_dir) {
+void Terrain::select_top_level(glm::vec3 player_pos, glm::vec3 player_dir, std::vector<PatchDraw>& draws) {
 
     int max_extent = (1 + render_distance) * heightMap.level_factor;
     int patch_increment = heightMap.level_factor;
 
-    unsigned long frame_triangles = 0;
-
     int min_x = floor_mult(player_pos.x - max_extent, heightMap.level_factor * 2);
     int max_x = floor_mult(player_pos.x + max_extent, heightMap.level_factor * 2);
     int min_y = floor_mult(player_pos.z - max_extent, heightMap.level_factor * 2);
@@ -143,23 +151,22 @@ unsigned long Terrain::render_terrain_top_level(glm::vec3 player_pos, glm::vec3
                 continue;
             }
 
-            frame_triangles += render_terrain_grid_square(player_pos, player_dir, grid_offset, patch_increment);
+            select_grid_square(player_pos, player_dir, grid_offset, patch_increment, draws);
         }
     }
 
     if (next_terrain != nullptr) {
-        frame_triangles += next_terrain->render_terrain_sub_level(
+        next_terrain->select_sub_level(
                 sub_level_grid_offsets,
                 patch_increment,
                 player_pos,
-                player_dir
+                player_dir,
+                draws
         );
     }
-    return frame_triangles;
 }
 
-unsigned long Terrain::render_terrain_sub_level(std::vector<glm::vec2> grid_offsets, int patch_increment, glm::vec3 player_pos, glm::vec3 player_dir){
-    unsigned long frame_triangles = 0;
+void Terrain::select_sub_level(std::vector<glm::vec2> grid_offsets, int patch_increment, glm::vec3 player_pos, glm::vec3 player_dir, std::vector<PatchDraw>& draws){
     std::vector<glm::vec2> sub_level_grid_offsets;
     int new_patch_increment = heightMap.level_factor;
     int ratio = patch_increment/new_patch_increment;// always 2 for now
@@ -175,44 +182,135 @@ unsigned long Terrain::render_terrain_sub_level(std::vector<glm::vec2> grid_offs
                 }
 
 
-                frame_triangles += render_terrain_grid_square(player_pos, player_dir, grid_offset ,new_patch_increment);
+                select_grid_square(player_pos, player_dir, grid_offset, new_patch_increment, draws);
             }
         }
     }
     //std::cout << "\n";
     if (next_terrain != nullptr){
-        frame_triangles += next_terrain->render_terrain_sub_level(sub_level_grid_offsets, new_patch_increment, player_pos, player_dir);
+        next_terrain->select_sub_level(sub_level_grid_offsets, new_patch_increment, player_pos, player_dir, draws);
     }
-
-    return frame_triangles;
 }
 
-unsigned long Terrain::render_terrain_grid_square(glm::vec3 player_pos, glm::vec3 player_dir, glm::vec2 grid_offset, int patch_increment){
-    unsigned long frame_triangles = 0;
-
+void Terrain::select_grid_square(glm::vec3 player_pos, glm::vec3 player_dir, glm::vec2 grid_offset, int patch_increment, std::vector<PatchDraw>& draws){
     // Draw the grid square if it's vaguely "in front of us" (cos(theta) > X) and within a reasonable
     // distance.
 
     float min_val = 0.5;
 
-    bool corner_tested = (glm::dot(player_dir, glm::normalize(glm::vec3(grid_offset.x,0.0,grid_offset.y) - player_pos)) > min_val)
-        ||(glm::dot(player_dir, glm::normalize(glm::vec3(grid_offset.x,0.0,grid_offset.y+patch_increment) - player_pos)) > min_val)
-        ||(glm::dot(player_dir, glm::normalize(glm::vec3(grid_offset.x+patch_increment,0.0,grid_offset.y) - player_pos)) > min_val)
-        ||(glm::dot(player_dir, glm::normalize(glm::vec3(grid_offset.x+patch_increment,0.0,grid_offset.y+patch_increment) - player_pos)) > min_val);
+    // Corners of the patch's bounding box, from its bounds pyramid once
+    // it's generated, or the level's whole height range until then. Heights
+    // are in world units; player_pos is in grid units.
+    auto [g_x, g_y] = heightMap.getPatchCoords(grid_offset.x, grid_offset.y);
+    float low, high;
+    if (!heightMap.heightBounds(g_x, g_y, g_x + patch_increment, g_y + patch_increment, low, high)) {
+        std::tie(low, high) = heightMap.heightRange();
+    }
+    bool corner_tested = false;
+    for (float y : {low / heightMap.grid_scale, high / heightMap.grid_scale}) {
+        for (glm::vec2 corner : {grid_offset, grid_offset + glm::vec2(0, patch_increment),
+                                 grid_offset + glm::vec2(patch_increment, 0), grid_offset + glm::vec2(patch_increment)}) {
+            corner_tested = corner_tested ||
+                glm::dot(player_dir, glm::normalize(glm::vec3(corner.x, y, corner.y) - player_pos)) > min_val;
+        }
+    }
 
+    float priority = patch_priority(player_pos, glm::vec2(g_x, g_y), corner_tested);
     if (corner_tested) {
+        draws.push_back({this, g_x, g_y, priority});
+    } else {
+        // not drawn, but generated in the background in case the player turns
+        heightMap.prefetchPatch(g_x, g_y, priority);
+    }
+}
 
-        start_drawing();
-        auto [g_x, g_y] = heightMap.getPatchCoords(grid_offset.x, grid_offset.y);
-        auto layer_idx = draw_patch(g_x, g_y);
-        grid_offset = {g_x, g_y};
-        glUniform1i(layer_location, layer_idx);
-        glUniform1i(level_factor_location, static_cast<GLint>(heightMap.level_factor));
+void Terrain::make_resident(std::vector<PatchDraw>& draws) {
+    // in the order selected, so coarser levels claim the upload budget first
+    for (auto& draw : draws) {
+        draw.source = draw.terrain;
+        draw.source_x = draw.x;
+        draw.source_y = draw.y;
+        draw.layer = draw.terrain->draw_patch(draw.x, draw.y, draw.priority);
+
+        // Until the patch is generated, stretch the covering part of the
+        // nearest ancestor level's patch over it instead.
+        while (draw.layer < 0 && draw.source->parent_terrain != nullptr) {
+            draw.source = draw.source->parent_terrain;
+            std::tie(draw.source_x, draw.source_y) = draw.source->heightMap.getPatchCoords(draw.x, draw.y);
+            draw.layer = draw.source->draw_patch(draw.source_x, draw.source_y, draw.priority);
+        }
+    }
+}
 
-        glUniform2fv(grid_offset_location, 1, glm::value_ptr(grid_offset));
+unsigned long Terrain::submit(const std::vector<PatchDraw>& draws) {
+    unsigned long frame_triangles = 0;
+    const Terrain* drawing = nullptr;
+    for (const auto& draw : draws) {
+        if (draw.layer < 0) {
+            continue;
+        }
+        const Terrain& terrain = *draw.terrain;
+        if (drawing != &terrain) {
+            terrain.start_drawing();
+            drawing = &terrain;
+        }
+        // every level's patches are in the one texture array
+        float source_factor = draw.source->heightMap.level_factor;
+        glm::vec2 tex_offset{(draw.x - draw.source_x) / source_factor, (draw.y - draw.source_y) / source_factor};
+        glUniform2fv(terrain.tex_offset_location, 1, glm::value_ptr(tex_offset));
+        glUniform1f(terrain.tex_scale_location, terrain.heightMap.level_factor / source_factor);
+        const auto& quantization = terrain.patch_layers.quantization[draw.layer];
+        glUniform3fv(terrain.patch_offset_location, 1, quantization.offset);
+        glUniform3fv(terrain.patch_range_location, 1, quantization.range);
+
+        glm::vec2 grid_offset{draw.x, draw.y};
+        glUniform1i(terrain.layer_location, draw.layer);
+        glUniform1i(terrain.level_factor_location, static_cast<GLint>(terrain.heightMap.level_factor));
+
+        glUniform2fv(terrain.grid_offset_location, 1, glm::value_ptr(grid_offset));
         glDrawElements(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, nullptr);
         frame_triangles += numIndices / 3;
     }
-
     return frame_triangles;
 }
+
+// Projects the player's path (velocity in grid units per second) ahead and
+// gets the patches along it generated, and staged for upload as they're
+// finished, before they're drawn, for this level and every level below it.
+// Nothing is uploaded nor given a layer until it's actually drawn. Requests
+// are renewed each frame like any other, so they lapse if the player
+// changes course.
+void Terrain::prefetch_path(glm::vec3 player_pos, glm::vec3 player_velocity, float seconds) {
+    const int max_steps = 64;
+    const int factor = heightMap.level_factor;
+    glm::vec2 start{player_pos.x, player_pos.z};
+    glm::vec2 travel = glm::vec2(player_velocity.x, player_velocity.z) * seconds;
+
+    // every patch within one patch width of the path, sampled every half width
+    int steps = std::min(max_steps, int(glm::length(travel) * 2 / factor));
+    std::vector<std::pair<int, int>> path_patches;
+    for (int step = 1; step <= steps; step++) {
+        glm::vec2 point = start + travel * (float(step) / steps);
+        auto [min_x, min_y] = heightMap.getPatchCoords(point.x - factor, point.y - factor);
+        for (int y = min_y; y <= point.y + factor; y += factor) {
+            for (int x = min_x; x <= point.x + factor; x += factor) {
+                path_patches.emplace_back(x, y);
+            }
+        }
+    }
+    std::sort(path_patches.begin(), path_patches.end());
+    path_patches.erase(std::unique(path_patches.begin(), path_patches.end()), path_patches.end());
+
+    for (auto [x, y] : path_patches) {
+        // after the patches being drawn now, nearest first
+        float priority = patch_priority(player_pos, glm::vec2(x, y), true) + 1;
+        if (!heightMap.patchStored(x, y)) {
+            heightMap.prefetchPatch(x, y, priority);
+            patch_uploader.want(level, x, y);
+        }
+    }
+
+    if (next_terrain != nullptr) {
+        next_terrain->prefetch_path(player_pos, player_velocity, seconds);
+    }
+}
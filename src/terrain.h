@@ -4,7 +4,7 @@
 #ifndef TERRAIN_GL_TERRAIN_H
 #define TERRAIN_GL_TERRAIN_H
 
-#include <map>
+#include <vector>
 #include <glm/glm.hpp>
 #include <glm/mat4x4.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -12,40 +12,75 @@
 #include <glm/gtx/transform.hpp>
 
 #include "heightmap.h"
+#include "patch_layers.h"
+#include "patch_upload.h"
 #include "shader.h"
+#include "terrain_config.h"
 
-const int grid_size = 64;   // edge length of each patch - must be multiple of 8, so 0.125 * grid_size is an int
-const int grid_scale = 64;  // patch size in world units
+const size_t patch_cache_bytes = 512 * 1024 * 1024;  // CPU patch cache budget, on top of patches resident on the GPU
+const float prefetch_seconds = 3;  // how far ahead along the player's path patches are prefetched
+const size_t upload_budget_bytes = 256 * 1024;  // patch texture uploads per frame, beyond which finer levels wait
+const float dem_spacing = 1.f / grid_scale;  // grid units between elevation model samples
+const float dem_height_scale = 1;  // world units per elevation model sample value
 const int skirtQuads = 4 * grid_size; // extra vertices for the skirts
 const int skirtVertices = 4 * (grid_size + 1);
 const int numIndices = (grid_size * grid_size + skirtQuads) * 2 * 3;
 const int numVertices = (grid_size+1) * (grid_size+1) + skirtVertices;
 
+class Terrain;
+
+// A patch selected to be drawn this frame. Once made resident, it's drawn
+// from layer, which holds either its own level's patch or the covering
+// patch of the nearest ancestor level (source) standing in for it.
+struct PatchDraw {
+    Terrain* terrain;
+    int x, y;
+    float priority;
+    Terrain* source = nullptr;
+    int source_x = 0, source_y = 0;
+    int layer = -1;
+};
+
+// Each frame is drawn in three phases: select_top_level() lists the
+// patches in view on every level, make_resident() then uploads any of
+// them not already on the GPU in one batch, and submit() only draws.
 class Terrain {
 public:
-    Terrain(int level, int render_distance, ShaderProgram& program, Terrain* next_level_down);
-    int draw_patch(int grid_x, int grid_y);
+    Terrain(int level, int render_distance, ShaderProgram& program, PatchStore<PatchSample>& patch_store,
+            PatchWorkers<PatchSample>& patch_workers, PatchUploader& patch_uploader, PatchLayers& patch_layers,
+            Terrain* next_level_down, const HeightSource* height_source = nullptr);
+    int draw_patch(int grid_x, int grid_y, float priority);
+    float patch_priority(glm::vec3 player_pos, glm::vec2 grid_offset, bool in_view) const;
     void start_drawing() const;
-    unsigned long render_terrain_top_level(glm::vec3 player_pos, glm::vec3 player_dir);
-    unsigned long render_terrain_sub_level(std::vector<glm::vec2> grid_offsets, int patch_increment, glm::vec3 player_pos, glm::vec3 player_dir);
-    unsigned long render_terrain_grid_square(glm::vec3 player_pos, glm::vec3 player_dir, glm::vec2 grid_offset, int patch_increment);
+    void select_top_level(glm::vec3 player_pos, glm::vec3 player_dir, std::vector<PatchDraw>& draws);
+    void select_sub_level(std::vector<glm::vec2> grid_offsets, int patch_increment, glm::vec3 player_pos, glm::vec3 player_dir, std::vector<PatchDraw>& draws);
+    void select_grid_square(glm::vec3 player_pos, glm::vec3 player_dir, glm::vec2 grid_offset, int patch_increment, std::vector<PatchDraw>& draws);
+    // finds (uploading if need be) the layer each selected patch is drawn from
+    static void make_resident(std::vector<PatchDraw>& draws);
+    // draws every resident patch, returning the number of triangles
+    static unsigned long submit(const std::vector<PatchDraw>& draws);
+    void prefetch_path(glm::vec3 player_pos, glm::vec3 player_velocity, float seconds);
 
     int render_distance;
-    HeightMap<float> heightMap;
+    HeightMap<PatchSample> heightMap;
 private:
-    std::map<std::pair<int, int>, int> grid_layer_map;  // (x,y) -> layer
-    std::map<int, std::pair<int, int>> layer_grid_map;  // layer -> (x,y)
-    int layer_count;
+    PatchStore<PatchSample>& patch_store;
+    PatchUploader& patch_uploader;
+    PatchLayers& patch_layers;  // shared by every level
     int adapted;
     int level;
-    GLuint texId;
     GLuint indicesIBO;
     GLuint positionVBO;
     GLint layer_location;
     GLint level_factor_location;
     GLint grid_offset_location;
+    GLint tex_offset_location;
+    GLint tex_scale_location;
+    GLint patch_offset_location;
+    GLint patch_range_location;
 
     Terrain* next_terrain;
+    Terrain* parent_terrain;  // the next level up, whose patches stand in for ours until they're ready
 };
 
 #endif //TERRAIN_GL_TERRAIN_H
@@ -0,0 +1,35 @@
+// terrain_gl
+// @codedstructure 2023
+
+#ifndef TERRAIN_GL_TERRAIN_CONFIG_H
+#define TERRAIN_GL_TERRAIN_CONFIG_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "generator.h"
+#include "heightmap.h"
+
+// Generation settings shared by the viewer and terrain_bake; patches baked
+// with different values aren't read back from the cache.
+const int grid_size = 64;   // edge length of each patch - must be multiple of 8, so 0.125 * grid_size is an int
+const int grid_scale = 64;  // patch size in world units
+const OctaveFill octave_fill = OctaveFill::Drop;  // what coarse levels do with octaves finer than their samples
+using PatchSample = uint16_t;  // how patches are stored: float, or uint16_t quantized per patch
+const PatchLayout patch_layout = PatchLayout::RowMajor;  // sample order within CPU-side patches
+const char* const patch_cache_path = "terrain_patches.cache";  // patches kept between runs
+const bool composed_heights = false;  // heights from composedSource() rather than the built-in fBm
+
+// The composed generator used when composed_heights is set, in place of the
+// built-in fBm (an elevation model given to the viewer still takes
+// precedence). Patches are cached per generator.
+inline const HeightSource* composedSource() {
+    static const GeneratorSource source(gen::blend(
+            gen::scaleBias(gen::ridged(gen::octaves(gen::simplex(), 6, 1.f / 32, 0.6f)), 60, -20),
+            gen::warp(gen::billow(gen::octaves(gen::simplex(), 8, 1.f / 16, 15)),
+                      gen::octaves(gen::simplex(), 2, 1.f / 8, 1), 2),
+            gen::scaleBias(gen::octaves(gen::simplex(), 2, 1.f / 256, 1), 0.5f, 0.5f)));
+    return composed_heights ? &source : nullptr;
+}
+
+#endif //TERRAIN_GL_TERRAIN_CONFIG_H